@@ -106,7 +106,6 @@ HEADERS += src/masternode/activemasternode.h \
            src/masternode/masternodeman.h \
            src/merkleblock.h \
            src/miner.h \
-           src/mruset.h \
            src/net.h \
            src/netbase.h \
            src/noui.h \
@@ -552,7 +551,6 @@ SOURCES += src/masternode/activemasternode.cpp \
            src/test/main_tests.cpp \
            src/test/mempool_tests.cpp \
            src/test/miner_tests.cpp \
-           src/test/mruset_tests.cpp \
            src/test/multisig_tests.cpp \
            src/test/netbase_tests.cpp \
            src/test/pmt_tests.cpp \
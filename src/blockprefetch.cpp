@@ -0,0 +1,173 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+CBlockPrefetcher::CBlockPrefetcher(CCoinsViewDB* pdbIn, unsigned int nMaxBlocksIn) : pdb(pdbIn), nMaxBlocks(nMaxBlocksIn), hashReading(0), fRunning(false), fStop(false)
+{
+}
+
+void CBlockPrefetcher::Request(const std::vector<std::pair<uint256, CDiskBlockPos> >& vBlocks)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    setWanted.clear();
+    vPending.clear();
+    for (size_t i = 0; i < vBlocks.size() && i < nMaxBlocks; i++) {
+        setWanted.insert(vBlocks[i].first);
+        if (!mapReady.count(vBlocks[i].first) && vBlocks[i].first != hashReading)
+            vPending.push_back(vBlocks[i]);
+    }
+    for (std::map<uint256, CPrefetchedBlock>::iterator it = mapReady.begin(); it != mapReady.end();) {
+        if (setWanted.count(it->first))
+            ++it;
+        else
+            mapReady.erase(it++);
+    }
+    if (!vPending.empty())
+        cond.notify_one();
+}
+
+bool CBlockPrefetcher::Take(const uint256& hash, CBlock& block, CCoinsViewCache& coins)
+{
+    CPrefetchedBlock entry;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // Being read right now: that is quicker than starting over
+        while (hashReading == hash)
+            cond.wait(lock);
+        std::map<uint256, CPrefetchedBlock>::iterator it = mapReady.find(hash);
+        if (it == mapReady.end()) {
+            // Not started yet; the caller reads it, so we don't have to
+            for (std::deque<std::pair<uint256, CDiskBlockPos> >::iterator itPending = vPending.begin(); itPending != vPending.end(); ++itPending) {
+                if (itPending->first == hash) {
+                    vPending.erase(itPending);
+                    break;
+                }
+            }
+            stats.nMisses++;
+            return false;
+        }
+        std::swap(entry, it->second);
+        mapReady.erase(it);
+        stats.nHits++;
+    }
+    block = entry.block;
+
+    // The database is only written with cs_main held, so it cannot change under us here
+    uint64_t nAdded = 0;
+    if (entry.nSequence == pdb->GetWriteSequence()) {
+        for (std::pair<uint256, CCoins>& coin : entry.vCoins)
+            if (coins.AddFetchedCoins(coin.first, coin.second))
+                nAdded++;
+    }
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nCoinsAdded += nAdded;
+    stats.nCoinsStale += entry.vCoins.size() - nAdded;
+    return true;
+}
+
+void CBlockPrefetcher::ReadCoins(CPrefetchedBlock& entry, int64_t& nTime)
+{
+    int64_t nStart = GetTimeMicros();
+    // An odd sequence means a write is in progress, and what we read may be torn
+    entry.nSequence = pdb->GetWriteSequence();
+    if (entry.nSequence % 2)
+        return;
+    // Outputs created in this block are not in the database yet
+    std::set<uint256> setSeen;
+    for (const CTransactionRef& tx : entry.block.vtx)
+        setSeen.insert(tx->GetHash());
+    for (const CTransactionRef& tx : entry.block.vtx) {
+        if (tx->IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx->vin) {
+            if (!setSeen.insert(txin.prevout.hash).second)
+                continue;
+            CCoins coins;
+            if (pdb->GetCoins(txin.prevout.hash, coins))
+                entry.vCoins.push_back(std::make_pair(txin.prevout.hash, coins));
+        }
+    }
+    nTime = GetTimeMicros() - nStart;
+}
+
+void CBlockPrefetcher::Thread()
+{
+    // Also clears fRunning when the thread is interrupted
+    struct CRunning {
+        CBlockPrefetcher& prefetcher;
+        CRunning(CBlockPrefetcher& prefetcherIn) : prefetcher(prefetcherIn)
+        {
+            boost::unique_lock<boost::mutex> lock(prefetcher.mutex);
+            prefetcher.fRunning = true;
+        }
+        ~CRunning()
+        {
+            boost::unique_lock<boost::mutex> lock(prefetcher.mutex);
+            prefetcher.fRunning = false;
+            prefetcher.hashReading = 0;
+            prefetcher.cond.notify_all();
+        }
+    } running(*this);
+
+    while (true) {
+        std::pair<uint256, CDiskBlockPos> next;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            hashReading = 0;
+            cond.notify_all();
+            while (vPending.empty() && !fStop)
+                cond.wait(lock);
+            if (fStop)
+                return;
+            next = vPending.front();
+            vPending.pop_front();
+            hashReading = next.first;
+        }
+
+        CPrefetchedBlock entry;
+        int64_t nStart = GetTimeMicros();
+        if (!ReadBlockFromDisk(entry.block, next.second) || entry.block.GetHash() != next.first)
+            continue;
+        int64_t nTimeBlock = GetTimeMicros() - nStart;
+        int64_t nTimeCoins = 0;
+        try {
+            ReadCoins(entry, nTimeCoins);
+        } catch (const std::exception& e) {
+            // Leave it to the connecting thread to run into and report a database error
+            LogPrint("bench", "%s: error reading coins: %s\n", __func__, e.what());
+            entry.vCoins.clear();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats.nBlocksRead++;
+        stats.nTimeBlocks += nTimeBlock;
+        stats.nCoinsRead += entry.vCoins.size();
+        stats.nTimeCoins += nTimeCoins;
+        // Request() may have moved on meanwhile
+        if (setWanted.count(next.first) && mapReady.size() < nMaxBlocks)
+            std::swap(mapReady[next.first], entry);
+    }
+}
+
+void CBlockPrefetcher::Stop()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = true;
+    vPending.clear();
+    cond.notify_all();
+    while (fRunning)
+        cond.wait(lock);
+}
+
+CBlockPrefetchStats CBlockPrefetcher::GetStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return stats;
+}
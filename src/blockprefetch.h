@@ -0,0 +1,110 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPREFETCH_H
+#define BITCOIN_BLOCKPREFETCH_H
+
+#include "chain.h"
+#include "coins.h"
+#include "primitives/block.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CCoinsViewDB;
+
+/** Default for -blockprefetch, the number of blocks read ahead of the one being connected */
+static const unsigned int DEFAULT_BLOCK_PREFETCH = 16;
+
+/** Counters of the read-ahead stages, logged with -debug=bench */
+struct CBlockPrefetchStats {
+    //! Blocks read from disk ahead of time, and the microseconds that took
+    uint64_t nBlocksRead;
+    int64_t nTimeBlocks;
+    //! Coins of their inputs read from the coin database, and the microseconds that took
+    uint64_t nCoinsRead;
+    int64_t nTimeCoins;
+    //! Blocks connected from memory, and those that still had to be read when their turn came
+    uint64_t nHits;
+    uint64_t nMisses;
+    //! Coins handed to the coins cache, and coins dropped because the database changed since they were read
+    uint64_t nCoinsAdded;
+    uint64_t nCoinsStale;
+
+    CBlockPrefetchStats() : nBlocksRead(0), nTimeBlocks(0), nCoinsRead(0), nTimeCoins(0), nHits(0), nMisses(0), nCoinsAdded(0), nCoinsStale(0) {}
+};
+
+/**
+ * Reads the blocks ActivateBestChainStep is about to connect from disk, together
+ * with the coins their inputs spend, on a thread of its own while the block
+ * before them is being verified.
+ *
+ * Coins are read straight from the coin database, never through pcoinsTip, which
+ * belongs to whoever holds cs_main. When a block is taken its coins are added to
+ * the coins cache, unless the database has been written to since they were read:
+ * until then they are exactly what the cache would fetch on a miss.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CPrefetchedBlock {
+        CBlock block;
+        std::vector<std::pair<uint256, CCoins> > vCoins;
+        //! Coin database write sequence the coins were read at
+        uint64_t nSequence;
+    };
+
+    CCoinsViewDB* pdb;
+    unsigned int nMaxBlocks;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! Blocks to read, in the order they will be connected
+    std::deque<std::pair<uint256, CDiskBlockPos> > vPending;
+    //! Blocks of the last request, read or not
+    std::set<uint256> setWanted;
+    //! Blocks read and not taken yet
+    std::map<uint256, CPrefetchedBlock> mapReady;
+    //! The block being read, or 0
+    uint256 hashReading;
+    bool fRunning;
+    bool fStop;
+    CBlockPrefetchStats stats;
+
+    void ReadCoins(CPrefetchedBlock& entry, int64_t& nTime);
+
+public:
+    CBlockPrefetcher(CCoinsViewDB* pdbIn, unsigned int nMaxBlocksIn);
+
+    /**
+     * The blocks that will be connected next, in order. The first nMaxBlocks of
+     * them are read ahead; blocks read earlier that are not among those are dropped.
+     */
+    void Request(const std::vector<std::pair<uint256, CDiskBlockPos> >& vBlocks);
+
+    /**
+     * Hand over the block with this hash if it was read ahead, and add the coins
+     * its inputs spend to coins, which must be backed by the coin database
+     * directly. Requires cs_main, which every write to the database holds.
+     */
+    bool Take(const uint256& hash, CBlock& block, CCoinsViewCache& coins);
+
+    //! Read requested blocks until Stop() is called
+    void Thread();
+
+    //! Make Thread() return, and wait until it has
+    void Stop();
+
+    CBlockPrefetchStats GetStats();
+};
+
+#endif // BITCOIN_BLOCKPREFETCH_H
@@ -211,7 +211,8 @@ public:
         SetNull();
     }
 
-    CBlockIndex(const CBlock& block)
+    //! Proof-of-stake data needs the block's transactions, AcceptBlock sets it when they arrive
+    CBlockIndex(const CBlockHeader& block)
     {
         SetNull();
 
@@ -220,24 +221,6 @@ public:
         nTime = block.nTime;
         nBits = block.nBits;
         nNonce = block.nNonce;
-
-        //Proof of Stake
-        bnChainTrust = uint256();
-        nMint = 0;
-        nMoneySupply = 0;
-        nFlags = 0;
-        nStakeModifier = 0;
-        nStakeModifierChecksum = 0;
-        hashProofOfStake = uint256();
-
-        if (block.IsProofOfStake()) {
-            SetProofOfStake();
-            prevoutStake = block.vtx[1].vin[0].prevout;
-            nStakeTime = block.nTime;
-        } else {
-            prevoutStake.SetNull();
-            nStakeTime = 0;
-        }
     }
     
 
@@ -6,6 +6,10 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdint.h>
 #include <vector>
 
 #include <boost/thread/condition_variable.hpp>
@@ -24,11 +28,22 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a deque of its own that added checks are spread over.
+  * A thread takes batches from the back of its own deque and, once that is
+  * empty, steals from the front of the others. The shared mutex only guards
+  * the counters; the checks themselves are moved under the deques' locks.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    //! Checks handed to one thread. Its owner takes from the back, other threads steal from the front.
+    struct CWorkQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -38,9 +53,8 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! One deque per thread: the master uses the first, workers share out the rest
+    std::vector<std::unique_ptr<CWorkQueue> > vQueues;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
@@ -48,28 +62,74 @@ private:
     //! The total number of workers (including the master).
     int nTotal;
 
+    //! The number of worker threads that have started, used to hand out deques.
+    unsigned int nWorkers;
+
+    //! The deque the next Add() starts filling.
+    unsigned int nNextQueue;
+
     //! The temporary evaluation result.
     bool fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
+     * This includes elements that are not anymore in a deque, but still in
      * worker's own batches.
      */
     unsigned int nTodo;
 
+    //! Number of verifications in the deques that no thread has claimed yet.
+    unsigned int nQueued;
+
     //! Whether we're shutting down.
     bool fQuit;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Up to this many verifications are run by CCheckQueueControl itself, without waking any worker
+    unsigned int nInlineMax;
+
+    //! Number of times a thread took checks from another thread's deque
+    std::atomic<uint64_t> nStolen;
+
+    /**
+     * Move nNow claimed verifications into vChecks: first the newest of our own
+     * deque, then the oldest of the others. Claims never exceed what the deques
+     * hold, so the loop finds them even while other threads take theirs.
+     */
+    void Take(unsigned int nQueue, unsigned int nNow, std::vector<T>& vChecks)
+    {
+        vChecks.resize(nNow);
+        unsigned int nTaken = 0;
+        {
+            CWorkQueue& own = *vQueues[nQueue];
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            while (nTaken < nNow && !own.queue.empty()) {
+                vChecks[nTaken++].swap(own.queue.back());
+                own.queue.pop_back();
+            }
+        }
+        for (unsigned int i = 1; nTaken < nNow; i++) {
+            CWorkQueue& other = *vQueues[(nQueue + i) % vQueues.size()];
+            boost::unique_lock<boost::mutex> lock(other.mutex);
+            if (other.queue.empty())
+                continue;
+            nStolen++;
+            while (nTaken < nNow && !other.queue.empty()) {
+                vChecks[nTaken++].swap(other.queue.front());
+                other.queue.pop_front();
+            }
+        }
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
+        unsigned int nQueue = 0;
         unsigned int nNow = 0;
         bool fOk = true;
         do {
@@ -85,9 +145,11 @@ private:
                 } else {
                     // first iteration
                     nTotal++;
+                    if (!fMaster && vQueues.size() > 1)
+                        nQueue = 1 + nWorkers++ % (vQueues.size() - 1);
                 }
                 // logically, the do loop starts here
-                while (queue.empty()) {
+                while (nQueued == 0) {
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
@@ -106,17 +168,13 @@ private:
                 //   all workers finish approximately simultaneously.
                 // * Try to account for idle jobs which will instantly start helping.
                 // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
+                nNow = std::max(1U, std::min(nBatchSize, nQueued / (nTotal + nIdle + 1)));
+                nQueued -= nNow;
                 // Check whether we need to do work at all
                 fOk = fAllOk;
             }
+            // The claimed checks are moved out of the deques without holding the shared mutex
+            Take(nQueue, nNow, vChecks);
             // execute work
             for (T& check : vChecks)
                 if (fOk)
@@ -126,8 +184,15 @@ private:
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    /**
+     * Create a new check queue. The first nMaxThreads threads (including the
+     * master) get a deque of their own, further workers share them.
+     */
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxThreads = 1, unsigned int nInlineMaxIn = 0) : nIdle(0), nTotal(0), nWorkers(0), nNextQueue(0), fAllOk(true), nTodo(0), nQueued(0), fQuit(false), nBatchSize(nBatchSizeIn), nInlineMax(nInlineMaxIn), nStolen(0)
+    {
+        for (unsigned int i = 0; i < std::max(1U, nMaxThreads); i++)
+            vQueues.push_back(std::unique_ptr<CWorkQueue>(new CWorkQueue()));
+    }
 
     //! Worker thread
     void Thread()
@@ -144,15 +209,25 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
+        if (vChecks.empty())
+            return;
         boost::unique_lock<boost::mutex> lock(mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        // Spread the checks in slices over the deques of the threads that are running
+        unsigned int nActive = 1 + std::min(nWorkers, (unsigned int)vQueues.size() - 1);
+        size_t nSlice = (vChecks.size() + nActive - 1) / nActive;
+        for (size_t i = 0; i < vChecks.size(); i += nSlice) {
+            CWorkQueue& work = *vQueues[nNextQueue++ % nActive];
+            boost::unique_lock<boost::mutex> lockQueue(work.mutex);
+            for (size_t j = i; j < std::min(i + nSlice, vChecks.size()); j++) {
+                work.queue.push_back(T());
+                vChecks[j].swap(work.queue.back());
+            }
         }
         nTodo += vChecks.size();
+        nQueued += vChecks.size();
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -165,11 +240,20 @@ public:
         boost::unique_lock<boost::mutex> lock(mutex);
         return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
     }
+
+    unsigned int GetInlineMax() const { return nInlineMax; }
+
+    //! Number of times a thread took checks from another thread's deque, since startup
+    uint64_t GetStolen() const { return nStolen; }
 };
 
 /** 
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
+ *
+ * Checks are held back until there are more than the queue's inline maximum;
+ * if Wait() is reached before that, they are run right here and the queue's
+ * threads are never woken.
  */
 template <typename T>
 class CCheckQueueControl
@@ -177,9 +261,12 @@ class CCheckQueueControl
 private:
     CCheckQueue<T>* pqueue;
     bool fDone;
+    bool fQueued;
+    std::vector<T> vInline;
+    size_t nChecks;
 
 public:
-    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false), fQueued(false), nChecks(0)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
@@ -192,17 +279,45 @@ public:
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = true;
+        if (fQueued) {
+            fRet = pqueue->Wait();
+        } else {
+            for (T& check : vInline)
+                if (fRet)
+                    fRet = check();
+            vInline.clear();
+        }
         fDone = true;
         return fRet;
     }
 
     void Add(std::vector<T>& vChecks)
     {
-        if (pqueue != NULL)
+        if (pqueue == NULL)
+            return;
+        nChecks += vChecks.size();
+        if (fQueued) {
             pqueue->Add(vChecks);
+            return;
+        }
+        for (T& check : vChecks) {
+            vInline.push_back(T());
+            check.swap(vInline.back());
+        }
+        if (vInline.size() > pqueue->GetInlineMax()) {
+            fQueued = true;
+            pqueue->Add(vInline);
+            vInline.clear();
+        }
     }
 
+    //! Number of checks added so far
+    size_t GetCount() const { return nChecks; }
+
+    //! Whether the checks were handed to the queue rather than run inline
+    bool IsQueued() const { return fQueued; }
+
     ~CCheckQueueControl()
     {
         if (!fDone)
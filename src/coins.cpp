@@ -206,6 +206,19 @@ bool CCoinsViewCache::Flush()
     return fOk;
 }
 
+bool CCoinsViewCache::AddFetchedCoins(const uint256& txid, CCoins& coins)
+{
+    assert(!hasModifier);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return false;
+    coins.swap(ret.first->second.coins);
+    // As in FetchCoins: an empty entry in the parent lets ours be fresh
+    if (ret.first->second.coins.IsPruned())
+        ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    return true;
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
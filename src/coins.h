@@ -445,6 +445,13 @@ public:
      */
     CCoinsModifier ModifyCoins(const uint256& txid);
 
+    /**
+     * Cache coins for txid that were read elsewhere, unless txid is cached already.
+     * They must be what the base view would return for txid at this moment.
+     * Returns whether they were added.
+     */
+    bool AddFetchedCoins(const uint256& txid, CCoins& coins);
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,17 @@ public:
     CSHA256& Reset();
 };
 
+/**
+ * Pick the fastest SHA-256 implementations the CPU supports, and return a
+ * description of them. Call once at startup, before other threads hash.
+ */
+std::string SHA256AutoDetect();
+
+/**
+ * Compute the double SHA-256 of each of blocks consecutive 64-byte inputs,
+ * e.g. pairs of merkle tree nodes, into blocks consecutive 32-byte outputs.
+ * out may equal in.
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
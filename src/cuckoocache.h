@@ -0,0 +1,165 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include "uint256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/thread/mutex.hpp>
+
+/**
+ * A set of 256 bit keys in a fixed amount of memory, 32 bytes per key.
+ *
+ * Keys must be uniformly distributed and never zero, e.g. salted hashes: each of
+ * their eight 32 bit words picks one of the slots the key may live in. An insert
+ * into a key's full slots moves the occupant of one of them to another of its own
+ * slots, and so on for a bounded number of steps; the key displaced last is
+ * forgotten. The cache never grows and needs no separate eviction.
+ *
+ * Contains() takes no lock, so any number of threads may look keys up while one
+ * inserts; inserts are serialized by a mutex. A lookup racing with the slot it
+ * reads being rewritten may see a mix of the old and the new key's words. It then
+ * misses, unless the mix equals the key looked up, which for keys that are salted
+ * hashes is as unlikely as a hash collision.
+ */
+class CCuckooCache
+{
+public:
+    //! Slots a key may live in, one per 32 bit word of the key
+    static const int KEY_SLOTS = 8;
+
+private:
+    struct CEntry {
+        std::atomic<uint64_t> vWords[4];
+    };
+
+    std::unique_ptr<CEntry[]> pEntries;
+    uint32_t nEntries;
+    //! Longest chain of displacements an insert may cause
+    unsigned int nMaxDepth;
+    boost::mutex cs_insert;
+
+    static void GetWords(const uint256& key, uint64_t vWords[4])
+    {
+        memcpy(vWords, key.begin(), 32);
+    }
+
+    uint32_t GetSlot(const uint64_t vWords[4], int n) const
+    {
+        uint32_t nWord = (uint32_t)(vWords[n / 2] >> (32 * (n % 2)));
+        return (uint32_t)(((uint64_t)nWord * nEntries) >> 32);
+    }
+
+    bool IsEqual(uint32_t nSlot, const uint64_t vWords[4]) const
+    {
+        const CEntry& entry = pEntries[nSlot];
+        for (int i = 0; i < 4; i++)
+            if (entry.vWords[i].load(std::memory_order_acquire) != vWords[i])
+                return false;
+        return true;
+    }
+
+    bool IsEmpty(uint32_t nSlot) const
+    {
+        const CEntry& entry = pEntries[nSlot];
+        for (int i = 0; i < 4; i++)
+            if (entry.vWords[i].load(std::memory_order_relaxed) != 0)
+                return false;
+        return true;
+    }
+
+    void Read(uint32_t nSlot, uint64_t vWords[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            vWords[i] = pEntries[nSlot].vWords[i].load(std::memory_order_relaxed);
+    }
+
+    void Write(uint32_t nSlot, const uint64_t vWords[4])
+    {
+        for (int i = 0; i < 4; i++)
+            pEntries[nSlot].vWords[i].store(vWords[i], std::memory_order_release);
+    }
+
+public:
+    CCuckooCache() : nEntries(0), nMaxDepth(0) {}
+
+    /**
+     * Drop every key and size the cache to at most nBytes, at least one entry.
+     * Not thread safe: call before the cache is shared. Returns the number of entries.
+     */
+    uint32_t Setup(size_t nBytes)
+    {
+        nEntries = (uint32_t)std::max((size_t)1, std::min(nBytes / sizeof(CEntry), (size_t)std::numeric_limits<uint32_t>::max()));
+        pEntries.reset(new CEntry[nEntries]);
+        for (uint32_t n = 0; n < nEntries; n++)
+            for (int i = 0; i < 4; i++)
+                pEntries[n].vWords[i].store(0, std::memory_order_relaxed);
+        nMaxDepth = 1;
+        while (nMaxDepth < 32 && (1U << nMaxDepth) < nEntries)
+            nMaxDepth++;
+        return nEntries;
+    }
+
+    uint32_t Size() const { return nEntries; }
+
+    bool Contains(const uint256& key) const
+    {
+        if (nEntries == 0 || key == 0)
+            return false;
+        uint64_t vWords[4];
+        GetWords(key, vWords);
+        for (int n = 0; n < KEY_SLOTS; n++)
+            if (IsEqual(GetSlot(vWords, n), vWords))
+                return true;
+        return false;
+    }
+
+    void Insert(const uint256& key)
+    {
+        if (nEntries == 0 || key == 0)
+            return;
+        uint64_t vWords[4];
+        GetWords(key, vWords);
+
+        boost::mutex::scoped_lock lock(cs_insert);
+        if (Contains(key))
+            return;
+
+        // The slot the key in hand was just displaced from, so it is not put straight back
+        uint32_t nFrom = nEntries;
+        for (unsigned int nDepth = 0; nDepth <= nMaxDepth; nDepth++) {
+            for (int n = 0; n < KEY_SLOTS; n++) {
+                uint32_t nSlot = GetSlot(vWords, n);
+                if (IsEmpty(nSlot)) {
+                    Write(nSlot, vWords);
+                    return;
+                }
+            }
+            // All taken: displace the occupant of the slot after the one we came from
+            uint32_t nSlot = GetSlot(vWords, 0);
+            for (int n = 0; n < KEY_SLOTS; n++) {
+                if (GetSlot(vWords, n) == nFrom) {
+                    nSlot = GetSlot(vWords, (n + 1) % KEY_SLOTS);
+                    break;
+                }
+            }
+            uint64_t vDisplaced[4];
+            Read(nSlot, vDisplaced);
+            Write(nSlot, vWords);
+            memcpy(vWords, vDisplaced, sizeof(vDisplaced));
+            nFrom = nSlot;
+        }
+        // vWords now holds the key that found no room; it is forgotten
+    }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
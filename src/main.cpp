@@ -14,11 +14,15 @@
 #include "alert.h"
 #include "banned.h"
 #include "base58.h"
+#include "blockencodings.h"
+#include "blockprefetch.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode/masternode-budget.h"
@@ -34,6 +38,7 @@
 #include "swifttx.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -48,6 +53,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -85,6 +92,7 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+unsigned int nMempoolParallelInputs = DEFAULT_MEMPOOL_PARALLEL_INPUTS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
@@ -107,17 +115,9 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+COrphanTxPool orphanpool;
 map<uint256, int64_t> mapRejectedBlocks;
 
-
-void EraseOrphansFor(NodeId peer);
-
 static void CheckBlockIndex();
 
 /** Constant stuff for coinbase transactions we create: */
@@ -192,6 +192,19 @@ map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/** A block downloaded before the data of its parent, accepted once the parent's is. */
+struct BlockAwaitingParent {
+    boost::shared_ptr<CBlock> pblock;
+    NodeId nodeFrom;
+};
+/**
+ * Blocks fetched in parallel during headers-first sync that arrived out of order, by hash and
+ * by parent hash. Stake validation needs the parent connected, so they wait here rather than
+ * being stored. Protected by cs_main.
+ */
+map<uint256, BlockAwaitingParent> mapBlocksAwaitingParent;
+multimap<uint256, uint256> mapBlocksAwaitingParentByPrev;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -242,6 +255,8 @@ struct CNodeState {
     CBlockIndex* pindexLastCommonBlock;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! Headers messages in a row from this peer that did not connect to our block index.
+    int nUnconnectingHeaders;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
@@ -250,6 +265,12 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Block we are rebuilding from this peer's cmpctblock while waiting for its blocktxn
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    uint256 hashPartialBlock;
+    //! When the cmpctblock of partialBlock arrived (in microseconds) and its size
+    int64_t nPartialBlockTime;
+    uint64_t nPartialBlockBytes;
 
     CNodeState()
     {
@@ -260,16 +281,37 @@ struct CNodeState {
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
+        nUnconnectingHeaders = 0;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
         fHaveWitness = false;
+        hashPartialBlock = uint256(0);
+        nPartialBlockTime = 0;
+        nPartialBlockBytes = 0;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Peers we asked to push new blocks as cmpctblock, oldest first. Requires cs_main. */
+list<NodeId> lNodesAnnouncingCmpctBlocks;
+
+/** Compact block relay statistics. Requires cs_main. */
+CCompactBlockStats compactBlockStats;
+
+/**
+ * Blocks recently served to peers, kept as ready-to-send messages so that a block
+ * requested by many peers is read from disk and serialized once. Keyed by the block
+ * hash and whether witness data is included, most recently used first. Requires cs_main.
+ */
+typedef std::pair<uint256, bool> ServedBlockKey;
+typedef list<pair<ServedBlockKey, CSerializedNetMsg> > ServedBlockList;
+ServedBlockList lServedBlocks;
+map<ServedBlockKey, ServedBlockList::iterator> mapServedBlocks;
+CServedBlockCacheStats servedBlockCacheStats;
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -323,7 +365,8 @@ void FinalizeNode(NodeId nodeid)
 
     for (const QueuedBlock& entry : state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
+    lNodesAnnouncingCmpctBlocks.remove(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -476,6 +519,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksAwaitingParent.count(pindex->GetBlockHash())) {
+                // Downloaded already, waiting for the data of an earlier block.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -552,87 +598,37 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CBlockPrefetcher* pblockprefetcher = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// orphanpool
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    for (const CTxIn& txin : tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    for (const CTxIn& txin : it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
+/** Expire and evict orphans so the pool stays within -maxorphantx and -maxorphantxsize. Requires cs_main. */
+unsigned int static LimitOrphanTxSize()
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    size_t nMaxOrphanTxSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+    orphanpool.Expire(GetTime());
+    return orphanpool.LimitSize(nMaxOrphanTx, nMaxOrphanTxSize);
 }
 
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+/**
+ * Whether every input of an orphan now refers to a transaction we know, either in
+ * the mempool or in the UTXO set. Orphans failing this would only be bounced by
+ * AcceptToMemoryPool with fMissingInputs set, so they are left in the pool untouched.
+ * Requires cs_main.
+ */
+bool static OrphanInputsAvailable(const CTransaction& tx)
 {
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
+    for (const CTxIn& txin : tx.vin) {
+        if (!mempool.exists(txin.prevout.hash) && !pcoinsTip->HaveCoins(txin.prevout.hash))
+            return false;
     }
-    return nEvicted;
+    return true;
 }
 
 bool IsStandardTx(const CTransaction& tx, string& reason)
@@ -1060,8 +1056,11 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags, PrecomputedTransactionData& txdata);
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
+    const CTransaction& tx = *ptx;
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -1166,7 +1165,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOpsCost);
+        CTxMemPoolEntry entry(ptx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOpsCost);
 
         unsigned int nSize = entry.GetTxSize();
 
@@ -1225,36 +1224,39 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true)) {
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputsForMempool(tx, state, view, scriptVerifyFlags, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true)) {
+            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
                 // Only the witness is wrong, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
+        // Check again against the consensus script verification flags the next
+        // block is checked with (GetBlockScriptFlags), in case of bugs in the
+        // standard flags that cause transactions to pass as valid when they're
+        // actually invalid. For
         // instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+        // can be exploited as a DoS attack. Passing with the block's flags also
+        // lets ConnectBlock find the transaction in the script execution cache.
+        if (!CheckInputsForMempool(tx, state, view, GetBlockScriptFlags(chainActive.Tip()->GetBlockTime()), txdata)) {
+            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against the block's consensus flags but not STANDARD flags %s", hash.ToString());
         }
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
     }
 
-    SyncWithWallets(tx, NULL);
+    SyncWithWallets(ptx, NULL);
 
     return true;
 }
@@ -1391,7 +1393,7 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOpsCost);
+        CTxMemPoolEntry entry(MakeTransactionRef(tx), nFees, GetTime(), dPriority, chainActive.Height(), nSigOpsCost);
 
         unsigned int nSize = entry.GetTxSize();
 
@@ -1450,7 +1452,8 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         // Ignore for block 300 (bug)
         if (hash.ToString() != "508256818225bcaa45c39027e9b563c270182e0fb877308dd8883106931ebeb0")
         {
-            if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+            PrecomputedTransactionData txdata(tx);
+            if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata)) {
                 return error("AcceptableInputs: : ConnectInputs failed %s", hash.ToString());
             }
         }
@@ -1467,7 +1470,7 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         // for any real tx this will be checked on AcceptToMemoryPool anyway
         //        if (!CheckInputs(tx, state, view, false, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
         //        {
-        //            return error("AcceptableInputs: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+        //            return error("AcceptableInputs: : BUG! PLEASE REPORT THIS! ConnectInputs failed against the block's consensus flags but not STANDARD flags %s", hash.ToString());
         //        }
 
         // Store transaction in memory
@@ -1485,10 +1488,10 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     CBlockIndex* pindexSlow = NULL;
     {
         LOCK(cs_main);
-        {
-            if (mempool.lookup(hash, txOut)) {
-                return true;
-            }
+        CTransactionRef ptx = mempool.get(hash);
+        if (ptx) {
+            txOut = *ptx;
+            return true;
         }
 
         if (fTxIndex) {
@@ -1531,9 +1534,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
-            for (const CTransaction& tx : block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
+            for (const CTransactionRef& tx : block.vtx) {
+                if (tx->GetHash() == hash) {
+                    txOut = *tx;
                     hashBlock = pindexSlow->GetBlockHash();
                     return true;
                 }
@@ -1843,17 +1846,44 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
 }
 
+/**
+ * Transactions whose scripts all passed verification, keyed by a salted hash of
+ * (wtxid, flags). Whether a script passes depends on nothing but the spending
+ * transaction, the outputs it spends, which its prevouts commit to, and the flags.
+ * Filled by AcceptToMemoryPool so that ConnectBlock skips the script work of
+ * transactions it has already seen.
+ */
+static CCuckooCache scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce;
+
+void InitScriptExecutionCache()
+{
+    GetRandBytes(scriptExecutionCacheNonce.begin(), 32);
+    // -maxsigcachesize is split evenly with the signature cache
+    size_t nMaxCacheSize = std::min(std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), MAX_MAX_SIG_CACHE_SIZE) * ((size_t)1 << 20) / 2;
+    uint32_t nEntries = scriptExecutionCache.Setup(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %u elements\n",
+        (nEntries * sizeof(uint256)) >> 20, nMaxCacheSize >> 20, nEntries);
+}
+
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(entry.begin());
+    return entry;
+}
+
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = (nIn < ptxTo->wit.vtxinwit.size()) ? &ptxTo->wit.vtxinwit[nIn].scriptWitness : NULL;
-    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks)
 {
     if (!tx.IsCoinBase()) {
         if (pvChecks)
@@ -1914,13 +1944,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Verified before with these flags, typically when it entered the mempool
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
+            if (scriptExecutionCache.Contains(hashCacheEntry))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1933,7 +1968,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1947,6 +1982,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Checks handed back through pvChecks have not run yet
+            if (cacheStore && !pvChecks)
+                scriptExecutionCache.Insert(hashCacheEntry);
         }
     }
 
@@ -1976,7 +2015,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction& tx = block.vtx[i];
+        const CTransaction& tx = *block.vtx[i];
 
         uint256 hash = tx.GetHash();
 
@@ -2071,7 +2110,23 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/**
+ * Blocks with at most this many script checks, typically just a coinstake, run
+ * them on the connecting thread: a check costs about as much as waking a worker.
+ */
+static const unsigned int SCRIPT_CHECK_INLINE_MAX = 4;
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS, SCRIPT_CHECK_INLINE_MAX);
+
+unsigned int GetBlockScriptFlags(int64_t nBlockTime)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+
+    if (GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) < nBlockTime) {
+        flags |= SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+    return flags;
+}
 
 void ThreadScriptCheck()
 {
@@ -2079,6 +2134,54 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+static CMempoolScriptStats mempoolScriptStats;
+
+/**
+ * CheckInputs for transactions entering the mempool. Transactions with at least
+ * nMempoolParallelInputs inputs have their scripts verified on the script check
+ * threads instead of serially. Callers hold cs_main, which also keeps ConnectBlock
+ * from using scriptcheckqueue at the same time.
+ */
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags, PrecomputedTransactionData& txdata)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+
+    if (!nScriptCheckThreads || !nMempoolParallelInputs || tx.vin.size() < nMempoolParallelInputs) {
+        bool fRet = CheckInputs(tx, state, view, true, flags, true, txdata);
+        mempoolScriptStats.nSerialTx++;
+        mempoolScriptStats.nSerialInputs += tx.vin.size();
+        mempoolScriptStats.nSerialMicros += GetTimeMicros() - nTimeStart;
+        return fRet;
+    }
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks))
+        return false;
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    bool fRet = control.Wait();
+    if (fRet)
+        scriptExecutionCache.Insert(GetScriptExecutionCacheEntry(tx, flags));
+    mempoolScriptStats.nParallelTx++;
+    mempoolScriptStats.nParallelInputs += tx.vin.size();
+    mempoolScriptStats.nParallelMicros += GetTimeMicros() - nTimeStart;
+    LogPrint("bench", "    - Parallel mempool script check of %s: %u inputs, %.2fms\n", tx.GetHash().ToString(), (unsigned int)tx.vin.size(), 0.001 * (GetTimeMicros() - nTimeStart));
+
+    // The queue only reports that some check failed. Redo the work serially so the
+    // rejection reason and DoS score are exactly those of the serial path.
+    if (!fRet)
+        return CheckInputs(tx, state, view, true, flags, true, txdata);
+    return true;
+}
+
+void GetMempoolScriptStats(CMempoolScriptStats& stats)
+{
+    LOCK(cs_main);
+    stats = mempoolScriptStats;
+}
+
 bool RecalculateSCCSupply(int nHeightStart)
 {
     if (nHeightStart > chainActive.Height())
@@ -2096,7 +2199,8 @@ bool RecalculateSCCSupply(int nHeightStart)
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 if (tx.IsCoinBase())
                     break;
@@ -2131,6 +2235,7 @@ bool RecalculateSCCSupply(int nHeightStart)
 }
 
 static int64_t nTimeVerify = 0;
+static int64_t nTimeVerifyWait = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
@@ -2216,7 +2321,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Now that the whole chain is irreversibly beyond that time it is applied to all blocks except the
     // two in the chain that violate it. This prevents exploiting the issue against nodes in their
     if (!pindex->phashBlock) {
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             const CCoins* coins = view.AccessCoins(tx.GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
@@ -2240,17 +2346,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     vPosTxid.reserve(block.vtx.size());
     CBlockUndo blockundo;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
     CAmount nValueOut = 0;
     CAmount nValueIn = 0;
 
-    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-
-    if (GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) < block.nTime) {
-        flags |= SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(block.nTime);
 
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        const CTransaction& tx = block.vtx[i];
+        const CTransaction& tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
         if (!tx.IsCoinBase()) {
@@ -2273,7 +2377,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("ConnectBlock(): too many sigops"),
                                 REJECT_INVALID, "bad-blk-sigops");
 
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            // The checks queued below keep a pointer to their transaction's entry, so txdata must never reallocate
+            txdata.emplace_back(tx);
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2323,7 +2429,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         CScript payOutEntry;
         payOutEntry << OP_DUP << OP_HASH160 << ParseHex("ae321cf6e1be3b0e0515a535b1fee8cb4a9159d4") << OP_EQUALVERIFY << OP_CHECKSIG;
         for (unsigned int i = 0; i < block.vtx.size(); i++) {
-           const CTransaction& tx = block.vtx[i];
+           const CTransaction& tx = *block.vtx[i];
            for (unsigned int v = 0; v < tx.vout.size(); v++) {
                if (tx.vout[v].scriptPubKey == payOutEntry &&
                    tx.vout[v].nValue == 2000000 * COIN) {
@@ -2345,11 +2451,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
+    uint64_t nStolenStart = scriptcheckqueue.GetStolen();
+    int64_t nTimeWaitStart = GetTimeMicros();
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros();
     nTimeVerify += nTime2 - nTimeStart;
+    nTimeVerifyWait += nTime2 - nTimeWaitStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), nTimeVerify * 0.000001);
+    LogPrint("bench", "      - %u script checks %s, wait for checks: %.2fms [%.2fs], %u batches stolen\n", control.GetCount(), control.IsQueued() ? "queued" : "inline",
+        0.001 * (nTime2 - nTimeWaitStart), nTimeVerifyWait * 0.000001, scriptcheckqueue.GetStolen() - nStolenStart);
 
     //IMPORTANT NOTE: Nothing before this point should actually store to disk (or even memory)
     if (fJustCheck)
@@ -2382,7 +2493,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.Error("Failed to write address index");
 
     // add new entries
-    for (const CTransaction& tx: block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if (tx.IsCoinBase())
             continue;
         for (const CTxIn in: tx.vin) {
@@ -2413,7 +2525,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros();
     nTimeCallbacks += nTime4 - nTime3;
@@ -2552,12 +2664,12 @@ bool static DisconnectTip(CValidationState& state, bool fBare)
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& tx : block.vtx) {
             // ignore validation errors in resurrected transactions
-            list<CTransaction> removed;
+            list<CTransactionRef> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-                mempool.remove(tx, removed, true);
+            if (tx->IsCoinBase() || tx->IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+                mempool.remove(*tx, removed, true);
         }
         mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
         mempool.check(pcoinsTip);
@@ -2567,7 +2679,7 @@ bool static DisconnectTip(CValidationState& state, bool fBare)
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    for (const CTransaction& tx : block.vtx) {
+    for (const CTransactionRef& tx : block.vtx) {
         SyncWithWallets(tx, NULL);
     }
     return true;
@@ -2592,11 +2704,13 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     if (pblock == NULL)
         fAlreadyChecked = false;
 
-    // Read block from disk.
+    // Read block from disk, unless it was read ahead.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    bool fReadAhead = false;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        fReadAhead = pblockprefetcher && pblockprefetcher->Take(pindexNew->GetBlockHash(), block, *pcoinsTip);
+        if (!fReadAhead && !ReadBlockFromDisk(block, pindexNew))
             return state.Error("Failed to read block");
         pblock = &block;
     }
@@ -2604,7 +2718,13 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     int64_t nTime2 = GetTimeMicros();
     nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]%s\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001, fReadAhead ? " (read ahead)" : "");
+    if (pblockprefetcher && LogAcceptCategory("bench")) {
+        CBlockPrefetchStats stats = pblockprefetcher->GetStats();
+        LogPrint("bench", "    - Read ahead: %u blocks (%.2fms/block), %u coins (%.3fms/coin), %u/%u blocks in time, %u coins cached, %u stale\n",
+            stats.nBlocksRead, stats.nBlocksRead ? 0.001 * stats.nTimeBlocks / stats.nBlocksRead : 0, stats.nCoinsRead, stats.nCoinsRead ? 0.001 * stats.nTimeCoins / stats.nCoinsRead : 0,
+            stats.nHits, stats.nHits + stats.nMisses, stats.nCoinsAdded, stats.nCoinsStale);
+    }
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -2635,18 +2755,18 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
 
     // Remove conflicting transactions from the mempool.
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    for (const CTransaction& tx : txConflicted) {
+    for (const CTransactionRef& tx : txConflicted) {
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    for (const CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& tx : pblock->vtx) {
         SyncWithWallets(tx, pblock);
     }
 
@@ -2690,7 +2810,7 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
     bool foundConflictingTx = false;
 
     //remove anything conflicting in the memory pool
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeConflicts(txLock, txConflicted);
 
 
@@ -2708,7 +2828,8 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
         // point should only happen with -reindex/-loadblock, or a misbehaving peer.
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             if (!tx.IsCoinBase()) {
                 for (const CTxIn& in1 : txLock.vin) {
                     for (const CTxIn& in2 : tx.vin) {
@@ -2850,6 +2971,17 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
         nHeight = nTargetHeight;
 
+        // Have the blocks that are on disk read ahead while earlier ones are connected
+        if (pblockprefetcher) {
+            std::vector<std::pair<uint256, CDiskBlockPos> > vBlocks;
+            BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
+                if ((pindexConnect == pindexMostWork && pblock) || !(pindexConnect->nStatus & BLOCK_HAVE_DATA))
+                    continue;
+                vBlocks.push_back(std::make_pair(pindexConnect->GetBlockHash(), pindexConnect->GetBlockPos()));
+            }
+            pblockprefetcher->Request(vBlocks);
+        }
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
             if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
@@ -2925,11 +3057,29 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            // Peers that asked for high-bandwidth compact relay get the block itself, skipping the inv/getdata round-trip
+            CSerializedNetMsg msgCmpctBlock;
+            uint64_t nCmpctSent = 0;
             {
                 LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (pnode->fPreferCmpctBlocks && pblock && pblock->GetHash() == hashNewTip) {
+                        // Serialized once, every high-bandwidth peer shares the same buffer
+                        if (!msgCmpctBlock)
+                            msgCmpctBlock = CreateSerializedNetMsg(0, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(*pblock));
+                        pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                        pnode->PushSerializedMessage(msgCmpctBlock);
+                        nCmpctSent++;
+                    } else {
                         pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                    }
+                }
+            }
+            if (nCmpctSent > 0) {
+                LOCK(cs_main);
+                compactBlockStats.nSent += nCmpctSent;
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -3025,7 +3175,42 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlock& block)
+/**
+ * Compute the proof-of-stake data of an index entry (chain trust, entropy bit, proof hash
+ * and stake modifier). These depend on the block's transactions and on the same data of
+ * its ancestors, so blocks indexed from their header alone get them once their data is
+ * accepted, which happens in chain order.
+ */
+static void ComputeBlockIndexStakeData(CBlockIndex* pindexNew)
+{
+    uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute chain trust score
+    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: record proof-of-stake hash value
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
+        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+}
+
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 {
     // Check for duplicate
     uint256 hash = block.GetHash();
@@ -3041,11 +3226,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     // competitive advantage.
     pindexNew->nSequenceId = 0;
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-
-    //mark as PoS seen
-    if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end()) {
@@ -3055,30 +3235,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
 
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
-
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -3229,6 +3385,95 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
+/** Blocks with fewer transactions than this have them checked on the calling thread */
+static const size_t BLOCK_CHECK_PARALLEL_MIN_TX = 64;
+/** Transactions handed to a block check thread at a time */
+static const size_t BLOCK_CHECK_SLICE = 16;
+
+/**
+ * Context-free work on a slice of a block's transactions: the coinbase and
+ * coinstake position rules and legacy sigop count of CheckBlock, or the witness
+ * hashes ContextualCheckBlock builds the witness merkle tree from.
+ */
+class CBlockTxCheck
+{
+private:
+    const CBlock* pblock;
+    size_t nBegin;
+    size_t nEnd;
+    std::atomic<unsigned int>* pnSigOps;
+    std::vector<uint256>* pvLeaves;
+
+public:
+    CBlockTxCheck() : pblock(NULL), nBegin(0), nEnd(0), pnSigOps(NULL), pvLeaves(NULL) {}
+    CBlockTxCheck(const CBlock& block, size_t nBeginIn, size_t nEndIn, std::atomic<unsigned int>* pnSigOpsIn, std::vector<uint256>* pvLeavesIn) :
+        pblock(&block), nBegin(nBeginIn), nEnd(nEndIn), pnSigOps(pnSigOpsIn), pvLeaves(pvLeavesIn) {}
+
+    bool operator()()
+    {
+        bool fProofOfStake = pblock->IsProofOfStake();
+        unsigned int nSigOps = 0;
+        for (size_t i = nBegin; i < nEnd; i++) {
+            const CTransaction& tx = *pblock->vtx[i];
+            if (pnSigOps) {
+                if (i >= 1 && tx.IsCoinBase())
+                    return false;
+                if (i >= 2 && fProofOfStake && tx.IsCoinStake())
+                    return false;
+                nSigOps += GetLegacySigOpCount(tx);
+            }
+            if (pvLeaves)
+                (*pvLeaves)[i] = i == 0 ? uint256() : tx.GetWitnessHash();
+        }
+        if (pnSigOps)
+            *pnSigOps += nSigOps;
+        return true;
+    }
+
+    void swap(CBlockTxCheck& check)
+    {
+        std::swap(pblock, check.pblock);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(pnSigOps, check.pnSigOps);
+        std::swap(pvLeaves, check.pvLeaves);
+    }
+};
+
+static CCheckQueue<CBlockTxCheck> blockcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
+/** CheckBlock is also called without cs_main, so the block check queue has a lock of its own */
+static boost::mutex cs_blockcheckqueue;
+
+void ThreadBlockCheck()
+{
+    RenameThread("stakecubecoin-blockch");
+    blockcheckqueue.Thread();
+}
+
+/**
+ * Run CBlockTxCheck over all transactions of a large block on the block check
+ * threads. Returns false without doing anything for small blocks, without
+ * threads or while another block is being checked, and returns false when a
+ * check failed: callers then do the work serially, which also finds the
+ * rejection reason.
+ */
+static bool CheckBlockTransactionsParallel(const CBlock& block, std::atomic<unsigned int>* pnSigOps, std::vector<uint256>* pvLeaves)
+{
+    if (!nScriptCheckThreads || block.vtx.size() < BLOCK_CHECK_PARALLEL_MIN_TX)
+        return false;
+    boost::unique_lock<boost::mutex> lock(cs_blockcheckqueue, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    std::vector<CBlockTxCheck> vChecks;
+    vChecks.reserve((block.vtx.size() + BLOCK_CHECK_SLICE - 1) / BLOCK_CHECK_SLICE);
+    for (size_t i = 0; i < block.vtx.size(); i += BLOCK_CHECK_SLICE)
+        vChecks.push_back(CBlockTxCheck(block, i, std::min(i + BLOCK_CHECK_SLICE, block.vtx.size()), pnSigOps, pvLeaves));
+    CCheckQueueControl<CBlockTxCheck> control(&blockcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 static int GetWitnessCommitmentIndex(const CBlock& block);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
 {
@@ -3274,21 +3519,29 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock() : first tx is not coinbase"),
             REJECT_INVALID, "bad-cb-missing");
-    for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
-            return state.DoS(100, error("CheckBlock() : more than one coinbase"),
-                REJECT_INVALID, "bad-cb-multiple");
+
+    // The per-transaction rules and the sigop count of large blocks are spread over
+    // the block check threads; the loops below only run if that was not done or failed
+    std::atomic<unsigned int> nSigOpsParallel(0);
+    bool fTxChecked = CheckBlockTransactionsParallel(block, &nSigOpsParallel, NULL);
+
+    if (!fTxChecked) {
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+            if (block.vtx[i]->IsCoinBase())
+                return state.DoS(100, error("CheckBlock() : more than one coinbase"),
+                    REJECT_INVALID, "bad-cb-multiple");
+    }
 
     if (block.IsProofOfStake()) {
         int commitpos = GetWitnessCommitmentIndex(block);
         if (commitpos >= 0) {
             if (IsSporkActive(SPORK_14_SEGWIT_ON_COINBASE)) {
-                if (block.vtx[0].vout.size() != 2)
+                if (block.vtx[0]->vout.size() != 2)
                     return state.DoS(100, error("CheckBlock() : coinbase output has wrong size for proof-of-stake block"));
-                if (!block.vtx[0].vout[1].scriptPubKey.IsUnspendable())
+                if (!block.vtx[0]->vout[1].scriptPubKey.IsUnspendable())
                     return state.DoS(100, error("CheckBlock() : coinbase must be unspendable for proof-of-stake block"));
             }
             else {
@@ -3296,24 +3549,27 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             }
         }
         else {
-            if (block.vtx[0].vout.size() != 1)
+            if (block.vtx[0]->vout.size() != 1)
                 return state.DoS(100, error("CheckBlock() : coinbase output has wrong size for proof-of-stake block"));
         }
         // Coinbase output should be empty if proof-of-stake block
-        if (!block.vtx[0].vout[0].IsEmpty())
+        if (!block.vtx[0]->vout[0].IsEmpty())
             return state.DoS(100, error("CheckBlock() : coinbase output not empty for proof-of-stake block"));
 
         // Second transaction must be coinstake, the rest must not be
-        if (block.vtx.empty() || !block.vtx[1].IsCoinStake())
+        if (block.vtx.empty() || !block.vtx[1]->IsCoinStake())
             return state.DoS(100, error("CheckBlock() : second tx is not coinstake"));
-        for (unsigned int i = 2; i < block.vtx.size(); i++)
-            if (block.vtx[i].IsCoinStake())
-                return state.DoS(100, error("CheckBlock() : more than one coinstake"));
+        if (!fTxChecked) {
+            for (unsigned int i = 2; i < block.vtx.size(); i++)
+                if (block.vtx[i]->IsCoinStake())
+                    return state.DoS(100, error("CheckBlock() : more than one coinstake"));
+        }
     }
 
     // ----------- swiftTX transaction scanning -----------
     if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
                 for (const CTxIn& in : tx.vin) {
@@ -3363,9 +3619,13 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
 
-    unsigned int nSigOps = 0;
-    for (const CTransaction& tx : block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
+    unsigned int nSigOps = nSigOpsParallel;
+    if (!fTxChecked) {
+        nSigOps = 0;
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
+            nSigOps += GetLegacySigOpCount(tx);
+        }
     }
     if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
@@ -3458,8 +3718,8 @@ static int GetWitnessCommitmentIndex(const CBlock& block)
 {
     int commitpos = -1;
     if(block.vtx.size() > 1) {
-        for (size_t o = 0; o < block.vtx[0].vout.size(); o++) {
-            if (block.vtx[0].vout[o].scriptPubKey.size() >= 38 && block.vtx[0].vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0].vout[o].scriptPubKey[1] == 0x24 && block.vtx[0].vout[o].scriptPubKey[2] == 0xaa && block.vtx[0].vout[o].scriptPubKey[3] == 0x21 && block.vtx[0].vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0].vout[o].scriptPubKey[5] == 0xed) {
+        for (size_t o = 0; o < block.vtx[0]->vout.size(); o++) {
+            if (block.vtx[0]->vout[o].scriptPubKey.size() >= 38 && block.vtx[0]->vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0]->vout[o].scriptPubKey[1] == 0x24 && block.vtx[0]->vout[o].scriptPubKey[2] == 0xaa && block.vtx[0]->vout[o].scriptPubKey[3] == 0x21 && block.vtx[0]->vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0]->vout[o].scriptPubKey[5] == 0xed) {
                 commitpos = o;
             }
         }
@@ -3471,10 +3731,12 @@ void UpdateUncommittedBlockStructures(CBlock& block, const CBlockIndex* pindexPr
 {
     int commitpos = GetWitnessCommitmentIndex(block);
     static const std::vector<unsigned char> nonce(32, 0x00);
-    if (commitpos != -1 && GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) < pindexPrev->nTime && block.vtx[0].wit.IsEmpty()) {
-        block.vtx[0].wit.vtxinwit.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+    if (commitpos != -1 && GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) < pindexPrev->nTime && block.vtx[0]->wit.IsEmpty()) {
+        CMutableTransaction tx(*block.vtx[0]);
+        tx.wit.vtxinwit.resize(1);
+        tx.wit.vtxinwit[0].scriptWitness.stack.resize(1);
+        tx.wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+        block.vtx[0] = MakeTransactionRef(std::move(tx));
     }
 }
 
@@ -3484,7 +3746,7 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
     int commitpos = GetWitnessCommitmentIndex(block);
     bool fHaveWitness = false;
     for (size_t t = 1; t < block.vtx.size(); t++) {
-        if (!block.vtx[t].wit.IsNull()) {
+        if (!block.vtx[t]->wit.IsNull()) {
             fHaveWitness = true;
             break;
         }
@@ -3505,8 +3767,9 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
             out.scriptPubKey[5] = 0xed;
             memcpy(&out.scriptPubKey[6], witnessroot.begin(), 32);
             commitment = std::vector<unsigned char>(out.scriptPubKey.begin(), out.scriptPubKey.end());
-            const_cast<std::vector<CTxOut>*>(&block.vtx[0].vout)->push_back(out);
-            block.vtx[0].UpdateHash();
+            CMutableTransaction tx(*block.vtx[0]);
+            tx.vout.push_back(out);
+            block.vtx[0] = MakeTransactionRef(std::move(tx));
         }
     }
     UpdateUncommittedBlockStructures(block, pindexPrev);
@@ -3542,8 +3805,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
 
     // Check that all transactions are finalized
-    for (const CTransaction& tx : block.vtx)
-        if (!IsFinalTx(tx, nHeight, block.GetBlockTime())) {
+    for (const CTransactionRef& tx : block.vtx)
+        if (!IsFinalTx(*tx, nHeight, block.GetBlockTime())) {
             return state.DoS(10, error("%s : contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
 
@@ -3552,8 +3815,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (block.nVersion >= 2 &&
         CBlockIndex::IsSuperMajority(2, pindexPrev, Params().EnforceBlockUpgradeMajority())) {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s : block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -3579,15 +3842,20 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
 
             bool malleated = false;
-            uint256 hashWitness = BlockWitnessMerkleRoot(block, &malleated);
+            uint256 hashWitness;
+            std::vector<uint256> vLeaves(block.vtx.size());
+            if (CheckBlockTransactionsParallel(block, NULL, &vLeaves))
+                hashWitness = ComputeMerkleRoot(vLeaves, &malleated);
+            else
+                hashWitness = BlockWitnessMerkleRoot(block, &malleated);
             // The malleation check is ignored; as the transaction tree itself
             // already does not permit it, it is impossible to trigger in the
             // witness tree.
-            if (block.vtx[0].wit.vtxinwit.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
+            if (block.vtx[0]->wit.vtxinwit.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
                 return state.DoS(100, error("%s : invalid witness nonce size", __func__), REJECT_INVALID, "bad-witness-nonce-size", true);
             }
-            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
-            if (memcmp(hashWitness.begin(), &block.vtx[0].vout[commitpos].scriptPubKey[6], 32)) {
+            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
+            if (memcmp(hashWitness.begin(), &block.vtx[0]->vout[commitpos].scriptPubKey[6], 32)) {
                 return state.DoS(100, error("%s : witness merkle commitment mismatch", __func__), REJECT_INVALID, "bad-witness-merkle-match", true);
             }
             fHaveWitness = true;
@@ -3597,7 +3865,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     // No witness data is allowed in blocks that don't commit to witness data, as this would otherwise leave room for spam
     if (!fHaveWitness) {
         for (size_t i = 0; i < block.vtx.size(); i++) {
-            if (!block.vtx[i].wit.IsNull()) {
+            if (!block.vtx[i]->wit.IsNull()) {
                 return state.DoS(100, error("%s : unexpected witness data found", __func__), REJECT_INVALID, "unexpected-witness", true);
             }
         }
@@ -3616,7 +3884,33 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex)
+/**
+ * Checks of a header received during headers-first sync that do not need the block's
+ * transactions. A proof-of-stake header cannot prove its stake without the coinstake,
+ * CheckWork verifies that once the block arrives; until then the difficulty and
+ * timestamp rules, and proof-of-work below LAST_POW_BLOCK, are all we can enforce.
+ */
+static bool CheckHeaderProof(const CBlockHeader& header, CValidationState& state, CBlockIndex* const pindexPrev)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    bool fProofOfStake = nHeight > Params().LAST_POW_BLOCK();
+
+    if (header.GetBlockTime() > GetAdjustedTime() + (fProofOfStake ? 180 : 7200))
+        return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
+
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("%s : incorrect difficulty at height %d", __func__, nHeight),
+            REJECT_INVALID, "bad-diffbits");
+
+    if (!fProofOfStake && !CheckProofOfWork(header.GetHash(), header.nBits))
+        return state.DoS(50, error("%s : proof of work failed", __func__),
+            REJECT_INVALID, "high-hash");
+
+    return true;
+}
+
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3677,6 +3971,43 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    if (headers.empty())
+        return true;
+
+    // Proof-of-stake headers cannot be verified before their blocks arrive. A branch that does not
+    // lead to more work than the active chain would never be downloaded, so it does not enter the index.
+    BlockMap::iterator mi = mapBlockIndex.find(headers[0].hashPrevBlock);
+    if (mi != mapBlockIndex.end() && !mapBlockIndex.count(headers.back().GetHash())) {
+        uint256 nChainWork = mi->second->nChainWork;
+        for (const CBlockHeader& header : headers)
+            nChainWork += GetBlockProof(CBlockIndex(header));
+        if (nChainWork <= chainActive.Tip()->nChainWork)
+            return state.DoS(0, error("%s : headers up to %s do not lead to more work than the active chain", __func__, headers.back().GetHash().ToString()),
+                0, "too-little-chainwork");
+    }
+
+    CBlockIndex* pindexLast = NULL;
+    for (const CBlockHeader& header : headers) {
+        if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash())
+            return state.DoS(20, error("%s : non-continuous headers sequence", __func__),
+                REJECT_INVALID, "bad-headers-sequence");
+
+        mi = mapBlockIndex.find(header.hashPrevBlock);
+        if (!mapBlockIndex.count(header.GetHash()) && mi != mapBlockIndex.end() && !CheckHeaderProof(header, state, mi->second))
+            return false;
+
+        if (!AcceptBlockHeader(header, state, &pindexLast))
+            return false;
+        if (ppindex)
+            *ppindex = pindexLast;
+    }
+
+    return true;
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock)
 {
     AssertLockHeld(cs_main);
@@ -3718,6 +4049,18 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    if (pindex->pprev) {
+        // The index was built from the header, the stake data needs the block's transactions
+        if (block.IsProofOfStake()) {
+            pindex->SetProofOfStake();
+            pindex->prevoutStake = block.vtx[1]->vin[0].prevout;
+            pindex->nStakeTime = block.nTime;
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        }
+        ComputeBlockIndexStakeData(pindex);
+        setDirtyBlockIndex.insert(pindex);
+    }
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3733,10 +4076,10 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
          CCoinsViewCache coins(pcoinsTip);
 
-         if (!coins.HaveInputs(block.vtx[1])) {
+         if (!coins.HaveInputs(*block.vtx[1])) {
             // the inputs are spent at the chain tip so we should look at the recently spent outputs
 
-             for (CTxIn in : block.vtx[1].vin) {
+             for (CTxIn in : block.vtx[1]->vin) {
                 auto it = mapStakeSpent.find(in.prevout);
                 if (it == mapStakeSpent.end()) {
                     return false;
@@ -3757,10 +4100,10 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
                 CBlock bl;
                 ReadBlockFromDisk(bl, last);
                 // loop through every spent input from said block
-                for (CTransaction t : bl.vtx) {
-                    for (CTxIn in: t.vin) {
+                for (const CTransactionRef& t : bl.vtx) {
+                    for (CTxIn in: t->vin) {
                         // loop through every spent input in the staking transaction of the new block
-                        for (CTxIn stakeIn : block.vtx[1].vin) {
+                        for (CTxIn stakeIn : block.vtx[1]->vin) {
                             // if they spend the same input
                             if (stakeIn.prevout == in.prevout) {
                                 // reject the block
@@ -4671,7 +5014,7 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
-        return txInMap || mapOrphanTransactions.count(inv.hash) ||
+        return txInMap || orphanpool.HaveTx(inv.hash) ||
                pcoinsTip->HaveCoins(inv.hash);
     }
     case MSG_BLOCK:
@@ -4728,6 +5071,33 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** The block message for pindex, from the served block cache or read from disk. Requires cs_main. */
+static CSerializedNetMsg GetServedBlockMessage(const CBlockIndex* pindex, bool fWitness)
+{
+    ServedBlockKey key(pindex->GetBlockHash(), fWitness);
+    map<ServedBlockKey, ServedBlockList::iterator>::iterator it = mapServedBlocks.find(key);
+    if (it != mapServedBlocks.end()) {
+        lServedBlocks.splice(lServedBlocks.begin(), lServedBlocks, it->second);
+        servedBlockCacheStats.nHits++;
+        servedBlockCacheStats.nHitBytes += it->second->second->size();
+        return it->second->second;
+    }
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        assert(!"cannot load block from disk");
+    CSerializedNetMsg msg = CreateSerializedNetMsg(fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+    servedBlockCacheStats.nMisses++;
+
+    lServedBlocks.push_front(make_pair(key, msg));
+    mapServedBlocks[key] = lServedBlocks.begin();
+    while (lServedBlocks.size() > MAX_SERVED_BLOCK_CACHE_SIZE) {
+        mapServedBlocks.erase(lServedBlocks.back().first);
+        lServedBlocks.pop_back();
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4746,7 +5116,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4764,35 +5134,49 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Once the upload target is reached, stop serving historical blocks to peers that are not whitelisted
+                if (send && !pfrom->fWhitelisted && CNode::OutboundTargetReached(true) &&
+                    (!chainActive.Contains(mi->second) || chainActive.Tip()->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE)) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                    // Older blocks are unlikely to be in the peer's mempool, send them in full
+                    bool fCmpctInFull = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK || fCmpctInFull) {
+                        // Full blocks are only read from disk and serialized on a cache miss
+                        pfrom->PushSerializedMessage(GetServedBlockMessage(mi->second, inv.type != MSG_BLOCK));
+                    } else {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_CMPCT_BLOCK) {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                            compactBlockStats.nSent++;
+                        }
+                        else // MSG_FILTERED_BLOCK)
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                for (PairType& pair : merkleBlock.vMatchedTxn)
+                                    if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second).GetKey()))
+                                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -4811,17 +5195,17 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsg>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_WITNESS_TX ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_WITNESS_TX ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, tx);
+                    CTransactionRef tx = mempool.get(inv.hash);
+                    if (tx) {
+                        pfrom->PushMessageWithFlag(inv.type == MSG_WITNESS_TX ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *tx);
                         pushed = true;
                     }
                 }
@@ -4929,7 +5313,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4949,882 +5333,1451 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+static bool ProcessVersionMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0) {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0) {
+        pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
     }
 
-    if (strCommand == NetMsgType::VERSION) {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0) {
-            pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 1);
-            return false;
-        }
-
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
-        if (!pfrom->fInbound)
-        {
-            addrman.SetServices(pfrom->addr, pfrom->nServices);
-        }
-        if (pfrom->nServicesExpected & ~pfrom->nServices)
-        {
-            LogPrint("net", "peer=%d does not offer the expected services (%08x offered, %08x expected); disconnecting\n", pfrom->id, pfrom->nServices, pfrom->nServicesExpected);
-            pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
-                               strprintf("Expected to offer services %08x", pfrom->nServicesExpected));
-            pfrom->fDisconnect = true;
-        }
-
-        if (pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand))
-            return false;
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+    if (!pfrom->fInbound)
+    {
+        addrman.SetServices(pfrom->addr, pfrom->nServices);
+    }
+    if (pfrom->nServicesExpected & ~pfrom->nServices)
+    {
+        LogPrint("net", "peer=%d does not offer the expected services (%08x offered, %08x expected); disconnecting\n", pfrom->id, pfrom->nServices, pfrom->nServicesExpected);
+        pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_NONSTANDARD,
+                           strprintf("Expected to offer services %08x", pfrom->nServicesExpected));
+        pfrom->fDisconnect = true;
+    }
 
-        if (!vRecv.empty())
-            vRecv >> addrFrom >> nNonce;
-        if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
-            pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
-        }
-        // broken releases with wrong blockchain data
-        if (pfrom->cleanSubVer == "/Stakecube:1.0.0/" || 
-            pfrom->cleanSubVer == "/Stakecube:1.3.0/") {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100); // instantly ban them because they have bad block data
-            return false;
-        }
-        if (!vRecv.empty())
-            vRecv >> pfrom->nStartingHeight;
-        if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+    if (pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand))
+        return false;
 
-        // Disconnect if we connected to ourself
-        if (nNonce == nLocalHostNonce && nNonce > 1) {
-            LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+    if (!vRecv.empty())
+        vRecv >> addrFrom >> nNonce;
+    if (!vRecv.empty()) {
+        vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
+        pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
+    }
+    // broken releases with wrong blockchain data
+    if (pfrom->cleanSubVer == "/Stakecube:1.0.0/" || 
+        pfrom->cleanSubVer == "/Stakecube:1.3.0/") {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 100); // instantly ban them because they have bad block data
+        return false;
+    }
+    if (!vRecv.empty())
+        vRecv >> pfrom->nStartingHeight;
+    if (!vRecv.empty())
+        vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+    else
+        pfrom->fRelayTxes = true;
 
-        pfrom->addrLocal = addrMe;
-        if (pfrom->fInbound && addrMe.IsRoutable()) {
-            SeenLocal(addrMe);
-        }
+    // Disconnect if we connected to ourself
+    if (nNonce == nLocalHostNonce && nNonce > 1) {
+        LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
 
-        // Send version eagerly
-        if (pfrom->fInbound)
-            pfrom->PushVersion();
+    pfrom->addrLocal = addrMe;
+    if (pfrom->fInbound && addrMe.IsRoutable()) {
+        SeenLocal(addrMe);
+    }
 
-        pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+    // Send version eagerly
+    if (pfrom->fInbound)
+        pfrom->PushVersion();
 
-        if((pfrom->nServices & NODE_WITNESS))
-        {
-            LOCK(cs_main);
-            State(pfrom->GetId())->fHaveWitness = true;
-        }
+    pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
-        // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+    if((pfrom->nServices & NODE_WITNESS))
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fHaveWitness = true;
+    }
 
-        // Change version
-        pfrom->PushMessage(NetMsgType::VERACK);
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+    // Potentially mark this peer as a preferred download peer.
+    UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
 
-        // StakeCubeCoin: We use certain sporks during IBD, so check to see if they are
-        // available. If not, ask the first peer connected for them.
-        bool fMissingSporks = !pSporkDB->SporkExists(SPORK_13_SEGWIT_ACTIVATION);
+    // Change version
+    pfrom->PushMessage(NetMsgType::VERACK);
+    pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
-        if (fMissingSporks || !fRequestedSporksIDB){
-            LogPrintf("asking peer for sporks\n");
-            pfrom->PushMessage(NetMsgType::GETSPORKS);
-            fRequestedSporksIDB = true;
-        }
+    // StakeCubeCoin: We use certain sporks during IBD, so check to see if they are
+    // available. If not, ask the first peer connected for them.
+    bool fMissingSporks = !pSporkDB->SporkExists(SPORK_13_SEGWIT_ACTIVATION);
 
-        if (!pfrom->fInbound) {
-            // Advertise our address
-            if (fListen && !IsInitialBlockDownload()) {
-                CAddress addr = GetLocalAddress(&pfrom->addr);
-                if (addr.IsRoutable()) {
-                    LogPrintf("ProcessMessages: advertising address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr);
-                } else if (IsPeerAddrLocalGood(pfrom)) {
-                    addr.SetIP(pfrom->addrLocal);
-                    LogPrintf("ProcessMessages: advertising address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr);
-                }
-            }
+    if (fMissingSporks || !fRequestedSporksIDB){
+        LogPrintf("asking peer for sporks\n");
+        pfrom->PushMessage(NetMsgType::GETSPORKS);
+        fRequestedSporksIDB = true;
+    }
 
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000) {
-                pfrom->PushMessage(NetMsgType::GETADDR);
-                pfrom->fGetAddr = true;
-            }
-            addrman.Good(pfrom->addr);
-        } else {
-            if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom) {
-                addrman.Add(addrFrom, addrFrom);
-                addrman.Good(addrFrom);
+    if (!pfrom->fInbound) {
+        // Advertise our address
+        if (fListen && !IsInitialBlockDownload()) {
+            CAddress addr = GetLocalAddress(&pfrom->addr);
+            if (addr.IsRoutable()) {
+                LogPrintf("ProcessMessages: advertising address %s\n", addr.ToString());
+                pfrom->PushAddress(addr);
+            } else if (IsPeerAddrLocalGood(pfrom)) {
+                addr.SetIP(pfrom->addrLocal);
+                LogPrintf("ProcessMessages: advertising address %s\n", addr.ToString());
+                pfrom->PushAddress(addr);
             }
         }
 
-        // Relay alerts
-        {
-            LOCK(cs_mapAlerts);
-            for (PAIRTYPE(const uint256, CAlert) & item : mapAlerts)
-                item.second.RelayTo(pfrom);
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000) {
+            pfrom->PushMessage(NetMsgType::GETADDR);
+            pfrom->fGetAddr = true;
         }
+        addrman.Good(pfrom->addr);
+    } else {
+        if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom) {
+            addrman.Add(addrFrom, addrFrom);
+            addrman.Good(addrFrom);
+        }
+    }
 
-        pfrom->fSuccessfullyConnected = true;
-
-        string remoteAddr;
-        if (fLogIPs)
-            remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
-
-        LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
-            pfrom->cleanSubVer, pfrom->nVersion,
-            pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
-            remoteAddr);
-
-        int64_t nTimeOffset = nTime - GetTime();
-        pfrom->nTimeOffset = nTimeOffset;
-        AddTimeData(pfrom->addr, nTimeOffset);
+    // Relay alerts
+    {
+        LOCK(cs_mapAlerts);
+        for (PAIRTYPE(const uint256, CAlert) & item : mapAlerts)
+            item.second.RelayTo(pfrom);
     }
 
+    pfrom->fSuccessfullyConnected = true;
 
-    else if (pfrom->nVersion == 0) {
-        // Must have a version message before anything else
-        LOCK(cs_main);
-        Misbehaving(pfrom->GetId(), 1);
-        return false;
-    }
+    string remoteAddr;
+    if (fLogIPs)
+        remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
 
+    LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
+        pfrom->cleanSubVer, pfrom->nVersion,
+        pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
+        remoteAddr);
 
-    else if (strCommand == NetMsgType::VERACK) {
-        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+    int64_t nTimeOffset = nTime - GetTime();
+    pfrom->nTimeOffset = nTimeOffset;
+    AddTimeData(pfrom->addr, nTimeOffset);
+    return true;
+}
 
-        // Mark this node as currently connected, so we update its timestamp later.
-        if (pfrom->fNetworkNode) {
-            LOCK(cs_main);
-            State(pfrom->GetId())->fCurrentlyConnected = true;
-        }
+static bool ProcessVerackMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+    // Mark this node as currently connected, so we update its timestamp later.
+    if (pfrom->fNetworkNode) {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fCurrentlyConnected = true;
     }
 
+    // Tell the peer we can rebuild blocks from cmpctblock, announcing them by inv for now
+    if (GetBoolArg("-compactblocks", DEFAULT_COMPACT_BLOCKS))
+        pfrom->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
+    return true;
+}
 
-    else if (strCommand == NetMsgType::ADDR) {
-        vector<CAddress> vAddr;
-        vRecv >> vAddr;
+static bool ProcessAddrMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CAddress> vAddr;
+    vRecv >> vAddr;
 
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
-            return true;
-        if (vAddr.size() > 1000) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message addr size() = %u", vAddr.size());
-        }
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
+        return true;
+    if (vAddr.size() > 1000) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message addr size() = %u", vAddr.size());
+    }
 
-        // Store the new addresses
-        vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        for (CAddress& addr : vAddr) {
-            boost::this_thread::interruption_point();
+    // Store the new addresses
+    vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    for (CAddress& addr : vAddr) {
+        boost::this_thread::interruption_point();
 
-            if (!(addr.nServices & NODE_NETWORK))
-                continue;
+        if (!(addr.nServices & NODE_NETWORK))
+            continue;
 
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable()) {
-                // Relay to a limited number of other nodes
-                {
-                    LOCK(cs_vNodes);
-                    // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    multimap<uint256, CNode*> mapMix;
-                    for (CNode* pnode : vNodes) {
-                        if (pnode->nVersion < CADDR_TIME_VERSION)
-                            continue;
-                        unsigned int nPointer;
-                        memcpy(&nPointer, &pnode, sizeof(nPointer));
-                        uint256 hashKey = hashRand ^ nPointer;
-                        hashKey = Hash(BEGIN(hashKey), END(hashKey));
-                        mapMix.insert(make_pair(hashKey, pnode));
-                    }
-                    int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable()) {
+            // Relay to a limited number of other nodes
+            {
+                LOCK(cs_vNodes);
+                // Use deterministic randomness to send to the same nodes for 24 hours
+                // at a time so the addrKnowns of the chosen nodes prevent repeats
+                static uint256 hashSalt;
+                if (hashSalt == 0)
+                    hashSalt = GetRandHash();
+                uint64_t hashAddr = addr.GetHash();
+                uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                multimap<uint256, CNode*> mapMix;
+                for (CNode* pnode : vNodes) {
+                    if (pnode->nVersion < CADDR_TIME_VERSION)
+                        continue;
+                    unsigned int nPointer;
+                    memcpy(&nPointer, &pnode, sizeof(nPointer));
+                    uint256 hashKey = hashRand ^ nPointer;
+                    hashKey = Hash(BEGIN(hashKey), END(hashKey));
+                    mapMix.insert(make_pair(hashKey, pnode));
                 }
+                int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
+                for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
+                    ((*mi).second)->PushAddress(addr);
             }
-            // Do not store addresses outside our network
-            if (fReachable)
-                vAddrOk.push_back(addr);
         }
-        addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
-            pfrom->fGetAddr = false;
-        if (pfrom->fOneShot)
-            pfrom->fDisconnect = true;
+        // Do not store addresses outside our network
+        if (fReachable)
+            vAddrOk.push_back(addr);
     }
+    addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000)
+        pfrom->fGetAddr = false;
+    if (pfrom->fOneShot)
+        pfrom->fDisconnect = true;
+    return true;
+}
 
+/** Whether our tip is recent enough to fetch announced blocks right away. Requires cs_main. */
+static bool CanDirectFetch()
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20;
+}
 
-    else if (strCommand == NetMsgType::INV) {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message inv size() = %u", vInv.size());
-        }
-
+static bool ProcessInvMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message inv size() = %u", vInv.size());
+    }
 
-        std::vector<CInv> vToFetch;
-
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
-        {
-            CInv &inv = vInv[nInv];
-
-            boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
+    LOCK(cs_main);
 
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+    std::vector<CInv> vToFetch;
 
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
-                pfrom->AskFor(inv);
+    for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
+    {
+        CInv &inv = vInv[nInv];
 
-            if (inv.type == MSG_TX && State(pfrom->GetId())->fHaveWitness) {
-                inv.type = MSG_WITNESS_TX;
-            }
+        boost::this_thread::interruption_point();
+        pfrom->AddInventoryKnown(inv);
 
-            if (inv.type == MSG_BLOCK) {
-                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // First request the headers preceding the announced block. In the normal fully-synced
-                    // case where a new block is announced that succeeds the current tip (no reorganization),
-                    // there are no such headers.
-                    // Secondly, and only when we are close to being synced, we request the announced block directly,
-                    // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
-                    // time the block arrives, the header chain leading up to it is already validated. Not
-                    // doing this will result in the received block being rejected as an orphan in case it is
-                    // not a direct successor.
-                    if (State(pfrom->GetId())->fHaveWitness &&
-                       (GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) > chainActive.Tip()->nTime || State(pfrom->GetId())->fHaveWitness)) {
-                        inv.type = MSG_WITNESS_BLOCK;
-                    }
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+        bool fAlreadyHave = AlreadyHave(inv);
+        LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+
+        if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
+            pfrom->AskFor(inv);
+
+        if (inv.type == MSG_TX && State(pfrom->GetId())->fHaveWitness) {
+            inv.type = MSG_WITNESS_TX;
+        }
+
+        if (inv.type == MSG_BLOCK) {
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+            if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                // First request the headers preceding the announced block. In the normal fully-synced
+                // case where a new block is announced that succeeds the current tip (no reorganization),
+                // there are no such headers.
+                // Secondly, and only when we are close to being synced, we request the announced block directly,
+                // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
+                // time the block arrives, the header chain leading up to it is already validated. Not
+                // doing this will result in the received block being rejected as an orphan in case it is
+                // not a direct successor.
+                bool fFetch = true;
+                if (pfrom->nVersion >= HEADERS_FIRST_VERSION && Params().HeadersFirstSyncingActive()) {
+                    pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash);
+                    fFetch = CanDirectFetch();
+                    if (fFetch)
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                }
+                if (State(pfrom->GetId())->fHaveWitness &&
+                   (GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) > chainActive.Tip()->nTime || State(pfrom->GetId())->fHaveWitness)) {
+                    inv.type = MSG_WITNESS_BLOCK;
                 }
+                // Near the tip the block's transactions are most likely in our mempool already
+                if (pfrom->fSupportsCmpctBlocks && GetBoolArg("-compactblocks", DEFAULT_COMPACT_BLOCKS) && !IsInitialBlockDownload())
+                    inv.type = MSG_CMPCT_BLOCK;
+                if (fFetch)
+                    vToFetch.push_back(inv);
+                LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
             }
+        }
 
-            // Track requests for our stuff
-            GetMainSignals().Inventory(inv.hash);
+        // Track requests for our stuff
+        GetMainSignals().Inventory(inv.hash);
 
-            if (pfrom->nSendSize > (SendBufferSize() * 2)) {
-                LOCK(cs_main);
-                return error("send buffer size() = %u", pfrom->nSendSize);
-            }
+        if (pfrom->nSendSize > (SendBufferSize() * 2)) {
+            LOCK(cs_main);
+            return error("send buffer size() = %u", pfrom->nSendSize);
         }
+    }
+
+    if (!vToFetch.empty())
+        pfrom->PushMessage(NetMsgType::GETDATA, vToFetch);
+    return true;
+}
 
-        if (!vToFetch.empty())
-            pfrom->PushMessage(NetMsgType::GETDATA, vToFetch);
+static bool ProcessGetDataMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message getdata size() = %u", vInv.size());
     }
 
+    if (fDebug || (vInv.size() != 1))
+        LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
 
-    else if (strCommand == NetMsgType::GETDATA) {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message getdata size() = %u", vInv.size());
-        }
+    if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
+        LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+    ProcessGetData(pfrom);
+    return true;
+}
 
-        if (fDebug || (vInv.size() != 1))
-            LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
+/** Handles getblocks, and getheaders from peers that predate headers-first sync; either is answered with block invs */
+static bool ProcessGetBlocksMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
 
-        if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
-            LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+    LOCK(cs_main);
 
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
+    // Find the last block the caller has in the main chain
+    CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+
+    // Send the rest of the chain
+    if (pindex)
+        pindex = chainActive.Next(pindex);
+    int nLimit = 500;
+    LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        if (pindex->GetBlockHash() == hashStop) {
+            LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
+        }
+        pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0) {
+            // When this block is requested, we'll send an inv that'll make them
+            // getblocks the next batch of inventory.
+            LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
+            break;
+        }
     }
+    return true;
+}
 
+/** Answers getheaders with the headers of the active chain following the locator */
+static bool ProcessGetHeadersMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Peers from before headers-first sync expect block invs, as for getblocks; so does every peer
+    // on networks that do not sync headers first
+    if (pfrom->nVersion < HEADERS_FIRST_VERSION || !Params().HeadersFirstSyncingActive())
+        return ProcessGetBlocksMessage(pfrom, strCommand, vRecv, nTimeReceived);
 
-    else if (strCommand == NetMsgType::GETBLOCKS || strCommand == NetMsgType::GETHEADERS) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
+    LOCK(cs_main);
 
-        // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+    // Our own header chain may still be far behind
+    if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
+        LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
+        return true;
+    }
 
-        // Send the rest of the chain
+    CBlockIndex* pindex = NULL;
+    if (locator.IsNull()) {
+        // If locator is null, return the hashStop block
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end())
+            return true;
+        pindex = (*mi).second;
+    } else {
+        // Find the last block the caller has in the main chain
+        pindex = FindForkInGlobalIndex(chainActive, locator);
         if (pindex)
             pindex = chainActive.Next(pindex);
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            if (pindex->GetBlockHash() == hashStop) {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0) {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
-            }
-        }
     }
 
+    // We must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+    vector<CBlock> vHeaders;
+    int nLimit = MAX_HEADERS_RESULTS;
+    LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+            break;
+    }
+    pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
+    return true;
+}
 
-    else if (strCommand == NetMsgType::HEADERS && Params().HeadersFirstSyncingActive()) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+/** Handles tx as well as masternode signed dstx */
+static bool ProcessTxMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    // Both messages start with the transaction, which the mempool then shares rather than copies
+    CTransactionRef ptx;
+    vRecv >> ptx;
+    const CTransaction& tx = *ptx;
+
+    //masternode signed transaction
+    bool ignoreFees = false;
+    CTxIn vin;
+    vector<unsigned char> vchSig;
+    int64_t sigTime;
+
+    if (strCommand == NetMsgType::DSTX) {
+        //these allow masternodes to publish a limited amount of free transactions
+        vRecv >> vin >> vchSig >> sigTime;
+
+        CMasternode* pmn = mnodeman.Find(vin);
+        if (pmn != NULL) {
+            if (!pmn->allowFreeTx) {
+                //multiple peers can send us a valid masternode transaction
+                if (fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString());
+                return true;
+            }
 
-        LOCK(cs_main);
+            std::string strMessage = tx.GetHash().ToString() + std::to_string(sigTime);
 
-        if (IsInitialBlockDownload())
-            return true;
+            std::string errorMessage = "";
+            if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+                LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString());
+                Misbehaving(pfrom->GetId(), 20);
+                return false;
+            }
 
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull()) {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-        } else {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
-        }
-
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        if (fDebug)
-            LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+            LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString());
+
+            ignoreFees = true;
+            pmn->allowFreeTx = false;
         }
-        pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
     }
 
+    CInv inv(MSG_TX, tx.GetHash());
+    pfrom->AddInventoryKnown(inv);
 
-    else if (strCommand == NetMsgType::TX || strCommand == NetMsgType::DSTX) {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
+    LOCK(cs_main);
 
-        //masternode signed transaction
-        bool ignoreFees = false;
-        CTxIn vin;
-        vector<unsigned char> vchSig;
-        int64_t sigTime;
+    bool fMissingInputs = false;
+    CValidationState state;
 
-        if (strCommand == NetMsgType::TX) {
-            vRecv >> tx;
-        } else if (strCommand == NetMsgType::DSTX) {
-            //these allow masternodes to publish a limited amount of free transactions
-            vRecv >> tx >> vin >> vchSig >> sigTime;
+    mapAlreadyAskedFor.erase(inv);
 
-            CMasternode* pmn = mnodeman.Find(vin);
-            if (pmn != NULL) {
-                if (!pmn->allowFreeTx) {
-                    //multiple peers can send us a valid masternode transaction
-                    if (fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString());
-                    return true;
-                }
+    if (AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, false, ignoreFees)) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+
+        uiInterface.NotifyTransaction(tx.GetHash());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
+            vector<uint256> vChildren;
+            orphanpool.GetChildren(vWorkQueue[i], vChildren);
+            for (const uint256& orphanHash : vChildren) {
+                const COrphanTx* pOrphan = orphanpool.GetTx(orphanHash);
+                if (!pOrphan)
+                    continue;
+                CTransactionRef porphanTx = pOrphan->tx;
+                const CTransaction& orphanTx = *porphanTx;
+                NodeId fromPeer = pOrphan->fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
 
-                std::string strMessage = tx.GetHash().ToString() + std::to_string(sigTime);
 
-                std::string errorMessage = "";
-                if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
-                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString());
-                    Misbehaving(pfrom->GetId(), 20);
-                    return false;
+                if(setMisbehaving.count(fromPeer))
+                    continue;
+                // Orphans with other parents still missing stay in the pool without a validation attempt
+                if(!OrphanInputsAvailable(orphanTx))
+                    continue;
+                if(AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                } else if(!fMissingInputs2) {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || State(fromPeer)->fHaveWitness))
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
                 }
+                mempool.check(pcoinsTip);
+            }
+        }
 
-                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString());
+        for (uint256 hash : vEraseQueue)orphanpool.EraseTx(hash);
+    } else if (fMissingInputs) {
+        orphanpool.AddTx(ptx, pfrom->GetId(), GetTime());
 
-                ignoreFees = true;
-                pmn->allowFreeTx = false;
+        // DoS prevention: do not allow the orphan pool to grow unbounded
+        unsigned int nEvicted = LimitOrphanTxSize();
+        if (nEvicted > 0)
+            LogPrint("mempool", "orphan pool overflow, removed %u tx\n", nEvicted);
+    } else {
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, state.GetRejectReason());
             }
         }
+    }
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+    if (strCommand == NetMsgType::DSTX) {
+        CInv inv(MSG_DSTX, tx.GetHash());
+        RelayInv(inv);
+    }
+
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        if (state.GetRejectCode() < REJECT_INTERNAL)
+            pfrom->PushMessage(NetMsgType::REJECT, strCommand, state.GetRejectCode(),
+                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0 && (!state.CorruptionPossible() || State(pfrom->id)->fHaveWitness))
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+    return true;
+}
+
+static bool ProcessHeadersMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore headers received while importing
+    if (!Params().HeadersFirstSyncingActive() || fImporting || fReindex)
+        return true;
 
+    std::vector<CBlockHeader> headers;
+
+    // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
+    unsigned int nCount = ReadCompactSize(vRecv);
+    if (nCount > MAX_HEADERS_RESULTS) {
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("headers message size = %u", nCount);
+    }
+    headers.resize(nCount);
+    for (unsigned int n = 0; n < nCount; n++) {
+        vRecv >> headers[n];
+        ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+    }
 
-        bool fMissingInputs = false;
-        CValidationState state;
+    LOCK(cs_main);
 
-        mapAlreadyAskedFor.erase(inv);
+    if (nCount == 0) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
+    // Headers that do not connect to anything we know: the peer reorganized or is further ahead
+    // than we asked. Ask again from our best header instead of rejecting them, but a peer that
+    // keeps sending them is not syncing with us and only costs bandwidth.
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (!mapBlockIndex.count(headers[0].hashPrevBlock)) {
+        nodestate->nUnconnectingHeaders++;
+        LogPrint("net", "unconnecting headers (%d in a row), getheaders (%d) to peer=%d\n", nodestate->nUnconnectingHeaders, pindexBestHeader->nHeight, pfrom->id);
+        pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256(0));
+        if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+            Misbehaving(pfrom->GetId(), 20);
+        return true;
+    }
+    nodestate->nUnconnectingHeaders = 0;
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+    CBlockIndex* pindexLast = NULL;
+    CValidationState state;
+    if (!ProcessNewBlockHeaders(headers, state, &pindexLast)) {
+        int nDoS;
+        if (state.IsInvalid(nDoS) && nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+        return error("headers from peer=%d not accepted: %s", pfrom->id, state.GetRejectReason());
+    }
 
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
+    if (pindexLast)
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-            uiInterface.NotifyTransaction(tx.GetHash());
+    if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        // Headers message had its maximum size; the peer may have more headers.
+        // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
+        // from there instead.
+        LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+        pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexLast), uint256(0));
+    }
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || State(fromPeer)->fHaveWitness))
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
+    CheckBlockIndex();
+    return true;
+}
 
-            for (uint256 hash : vEraseQueue)EraseOrphanTx(hash);
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
+/**
+ * Queue a block whose parent we only know by its header, it can be validated once the parent's
+ * data is accepted. Only blocks we requested from pfrom are kept, others are dropped and will be
+ * fetched by the block download logic. Returns whether the block was taken care of.
+ */
+static bool QueueBlockAwaitingParent(CNode* pfrom, const CBlock& block)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || (mi->second->nStatus & BLOCK_HAVE_DATA))
+        return false;
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->id, state.GetRejectReason());
+    uint256 hash = block.GetHash();
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId()) {
+        LogPrint("net", "Dropping unrequested block %s from peer=%d, its parent has no data yet\n", hash.ToString(), pfrom->id);
+        return true;
+    }
+    MarkBlockAsReceived(hash);
+
+    if (mapBlocksAwaitingParent.count(hash))
+        return true;
+    // The download window keeps this small, but never let it grow past it
+    if (mapBlocksAwaitingParent.size() >= BLOCK_DOWNLOAD_WINDOW) {
+        LogPrint("net", "Dropping block %s from peer=%d, too many blocks waiting for their parent\n", hash.ToString(), pfrom->id);
+        return true;
+    }
+    BlockAwaitingParent& entry = mapBlocksAwaitingParent[hash];
+    entry.pblock.reset(new CBlock(block));
+    entry.nodeFrom = pfrom->GetId();
+    mapBlocksAwaitingParentByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    LogPrint("net", "Block %s from peer=%d waits for its parent %s\n", hash.ToString(), pfrom->id, block.hashPrevBlock.ToString());
+    return true;
+}
+
+/**
+ * Process the queued blocks that were waiting for hashParent, and theirs in turn. Blocks
+ * building on a parent found invalid are dropped. Must be called without cs_main.
+ */
+static void ProcessBlocksAwaitingParent(const uint256& hashParent)
+{
+    // Parent hash, and whether its descendants are to be dropped
+    std::deque<std::pair<uint256, bool> > vParents(1, std::make_pair(hashParent, false));
+    while (!vParents.empty()) {
+        uint256 hashPrev = vParents.front().first;
+        bool fDrop = vParents.front().second;
+        vParents.pop_front();
+
+        std::vector<BlockAwaitingParent> vChildren;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+            if (mi == mapBlockIndex.end())
+                continue;
+            fDrop |= (mi->second->nStatus & BLOCK_FAILED_MASK) != 0;
+            if (!fDrop && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                continue;
+
+            typedef multimap<uint256, uint256>::iterator ByPrevIterator;
+            std::pair<ByPrevIterator, ByPrevIterator> range = mapBlocksAwaitingParentByPrev.equal_range(hashPrev);
+            for (ByPrevIterator it = range.first; it != range.second; ++it) {
+                map<uint256, BlockAwaitingParent>::iterator itBlock = mapBlocksAwaitingParent.find(it->second);
+                if (!fDrop)
+                    mapBlockSource[it->second] = itBlock->second.nodeFrom;
+                vChildren.push_back(itBlock->second);
+                mapBlocksAwaitingParent.erase(itBlock);
+            }
+            mapBlocksAwaitingParentByPrev.erase(range.first, range.second);
+        }
+
+        for (const BlockAwaitingParent& child : vChildren) {
+            if (!fDrop) {
+                CValidationState state;
+                ProcessNewBlock(state, NULL, child.pblock.get());
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    LOCK(cs_main);
+                    Misbehaving(child.nodeFrom, nDoS);
                 }
             }
+            vParents.push_back(std::make_pair(child.pblock->GetHash(), fDrop));
         }
+    }
+}
 
-        if (strCommand == NetMsgType::DSTX) {
-            CInv inv(MSG_DSTX, tx.GetHash());
-            RelayInv(inv);
+/** Hand a block received as block, cmpctblock or blocktxn to validation. Must be called without cs_main. */
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+    //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+    if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), block.GetHash()) != pfrom->vBlockRequested.end()) {
+            //we already asked for this block, so lets work backwards and ask for the previous block
+            pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), block.hashPrevBlock);
+            pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+        } else {
+            //ask to sync to this block
+            pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), block.GetHash());
+            pfrom->vBlockRequested.push_back(block.GetHash());
         }
+    } else {
+        pfrom->AddInventoryKnown(inv);
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            if (state.GetRejectCode() < REJECT_INTERNAL)
+        // Fetched in parallel ahead of its parent during headers-first sync
+        if (QueueBlockAwaitingParent(pfrom, block))
+            return;
+
+        CValidationState state;
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if(state.IsInvalid(nDoS)) {
                 pfrom->PushMessage(NetMsgType::REJECT, strCommand, state.GetRejectCode(),
-                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0 && (!state.CorruptionPossible() || State(pfrom->id)->fHaveWitness))
-                Misbehaving(pfrom->GetId(), nDoS);
+                                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+                if(nDoS > 0) {
+                    TRY_LOCK(cs_main, lockMain);
+                    if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+                }
+            }
+            //disconnect this node if its old protocol version
+            pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+
+            ProcessBlocksAwaitingParent(inv.hash);
+        } else {
+            LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
         }
     }
+}
 
+static bool ProcessBlockMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
-    {
-        std::vector<CBlockHeader> headers;
+    CBlock block;
+    vRecv >> block;
 
-        // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("headers message size = %u", nCount);
-        }
-        headers.resize(nCount);
-        for (unsigned int n = 0; n < nCount; n++) {
-            vRecv >> headers[n];
-            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+    ProcessReceivedBlock(pfrom, block, strCommand);
+    return true;
+}
+
+static bool ProcessSendCmpctMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    bool fAnnounceUsingCmpctBlock = false;
+    uint64_t nCmpctBlockVersion = 0;
+    vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+
+    // Versions we do not know are ignored, the peer may offer several
+    if (nCmpctBlockVersion == CMPCTBLOCKS_VERSION) {
+        pfrom->fSupportsCmpctBlocks = true;
+        pfrom->fPreferCmpctBlocks = fAnnounceUsingCmpctBlock;
+    }
+    return true;
+}
+
+/**
+ * Ask the peer that just gave us a block we could rebuild to push future blocks
+ * as cmpctblock, dropping the oldest of MAX_COMPACT_BLOCKS_HB_PEERS such peers.
+ * Only done once the block connected to the active chain. Must be called without cs_main.
+ */
+static void MaybeSetPeerAsAnnouncingCmpctBlocks(CNode* pfrom, const uint256& hashBlock)
+{
+    if (!GetBoolArg("-compactblockshb", DEFAULT_COMPACT_BLOCKS_HB) || !pfrom->fSupportsCmpctBlocks)
+        return;
+
+    NodeId nodeDropped = -1;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            return;
+        if (std::find(lNodesAnnouncingCmpctBlocks.begin(), lNodesAnnouncingCmpctBlocks.end(), pfrom->GetId()) != lNodesAnnouncingCmpctBlocks.end())
+            return;
+        if (lNodesAnnouncingCmpctBlocks.size() >= MAX_COMPACT_BLOCKS_HB_PEERS) {
+            nodeDropped = lNodesAnnouncingCmpctBlocks.front();
+            lNodesAnnouncingCmpctBlocks.pop_front();
         }
+        lNodesAnnouncingCmpctBlocks.push_back(pfrom->GetId());
+    }
+
+    LOCK(cs_vNodes);
+    for (CNode* pnode : vNodes) {
+        if (pnode->GetId() == nodeDropped)
+            pnode->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
+    }
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, true, CMPCTBLOCKS_VERSION);
+}
+
+static bool ProcessCmpctBlockMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    uint64_t nMessageBytes = vRecv.size();
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    vRecv >> cmpctblock;
 
+    uint256 hash = cmpctblock.header.GetHash();
+    CBlock block;
+    {
         LOCK(cs_main);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+            return true;
 
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
+        // Without the parent we cannot connect it anyway, let the block path sort out the sync
+        CNodeState* nodestate = State(pfrom->GetId());
+        int nFetchType = nodestate->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK;
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+            pfrom->PushMessage(NetMsgType::GETDATA, std::vector<CInv>(1, CInv(nFetchType, hash)));
             return true;
         }
-        CBlockIndex* pindexLast = NULL;
-        for (const CBlockHeader& header : headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
+        // Validate the header before spending a mempool scan on rebuilding the block
+        CValidationState state;
+        if (!ProcessNewBlockHeaders(std::vector<CBlockHeader>(1, cmpctblock.header), state)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                Misbehaving(pfrom->GetId(), nDoS);
+                return error("%s : invalid cmpctblock header %s from peer=%d: %s", __func__, hash.ToString(), pfrom->id, state.GetRejectReason());
             }
+            LogPrint("cmpctblock", "cmpctblock %s from peer=%d not accepted: %s\n", hash.ToString(), pfrom->id, state.GetRejectReason());
+            return true;
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        compactBlockStats.nReceived++;
+        int64_t nTimeStart = GetTimeMicros();
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+        ReadStatus status = partialBlock->InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("%s : invalid cmpctblock %s from peer=%d", __func__, hash.ToString(), pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            compactBlockStats.nFallbacks++;
+            pfrom->PushMessage(NetMsgType::GETDATA, std::vector<CInv>(1, CInv(nFetchType, hash)));
+            return true;
+        }
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexLast), uint256(0));
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock->IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (!req.indexes.empty()) {
+            // Keep the partial block until the peer answers our getblocktxn
+            nodestate->partialBlock = partialBlock;
+            nodestate->hashPartialBlock = hash;
+            nodestate->nPartialBlockTime = nTimeStart;
+            nodestate->nPartialBlockBytes = nMessageBytes;
+            req.blockhash = hash;
+            pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+            return true;
         }
 
-        CheckBlockIndex();
+        status = partialBlock->FillBlock(block, std::vector<CTransactionRef>());
+        if (status != READ_STATUS_OK) {
+            compactBlockStats.nFallbacks++;
+            pfrom->PushMessage(NetMsgType::GETDATA, std::vector<CInv>(1, CInv(nFetchType, hash)));
+            return true;
+        }
+        compactBlockStats.nReconstructed++;
+        compactBlockStats.nCompactBytes += nMessageBytes;
+        compactBlockStats.nBlockBytes += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        compactBlockStats.nReconstructMicros += GetTimeMicros() - nTimeStart;
     }
 
-    else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
-    {
-        CBlock block;
-        vRecv >> block;
+    ProcessReceivedBlock(pfrom, block, strCommand);
+    MaybeSetPeerAsAnnouncingCmpctBlocks(pfrom, block.GetHash());
+    return true;
+}
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+static bool ProcessGetBlockTxnMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    BlockTransactionsRequest req;
+    vRecv >> req;
 
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), block.GetHash()) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), block.GetHash());
-                pfrom->vBlockRequested.push_back(block.GetHash());
-            }
-        } else {
-            pfrom->AddInventoryKnown(inv);
+    LOCK(cs_main);
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage(NetMsgType::REJECT, strCommand, state.GetRejectCode(),
-                                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
-            }
-        }
+    BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+    if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+        LogPrint("cmpctblock", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+        return true;
+    }
+
+    // Only recent blocks can have been announced as cmpctblock, answer anything older with the full block
+    if (mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+        LogPrint("cmpctblock", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_CMPCTBLOCK_DEPTH);
+        CInv inv(State(pfrom->GetId())->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, req.blockhash);
+        pfrom->vRecvGetData.push_back(inv);
+        ProcessGetData(pfrom);
+        return true;
     }
 
+    CBlock block;
+    if (!ReadBlockFromDisk(block, mi->second))
+        assert(!"cannot load block from disk");
 
-    // This asymmetric behavior for inbound and outbound connections was introduced
-    // to prevent a fingerprinting attack: an attacker can send specific fake addresses
-    // to users' AddrMan and later request them by sending getaddr messages.
-    // Making users (which are behind NAT and can only make outgoing connections) ignore
-    // getaddr message mitigates the attack.
-    else if ((strCommand == NetMsgType::GETADDR) && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
-        vector<CAddress> vAddr = addrman.GetAddr();
-        for (const CAddress& addr : vAddr)
-            pfrom->PushAddress(addr);
+    BlockTransactions resp(req);
+    for (size_t i = 0; i < req.indexes.size(); i++) {
+        if (req.indexes[i] >= block.vtx.size()) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("%s : peer=%d sent us a getblocktxn with out-of-bounds tx indices", __func__, pfrom->id);
+        }
+        resp.txn[i] = block.vtx[req.indexes[i]];
     }
+    pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+    return true;
+}
 
+static bool ProcessBlockTxnMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
-    else if (strCommand == NetMsgType::MEMPOOL) {
-        LOCK2(cs_main, pfrom->cs_filter);
+    uint64_t nMessageBytes = vRecv.size();
+    BlockTransactions resp;
+    vRecv >> resp;
 
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-        vector<CInv> vInv;
-        for (uint256& hash : vtxid) {
-            CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
-                (!pfrom->pfilter))
-                vInv.push_back(inv);
-            if (vInv.size() == MAX_INV_SZ) {
-                pfrom->PushMessage(NetMsgType::INV, vInv);
-                vInv.clear();
-            }
+    CBlock block;
+    {
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+            LogPrint("cmpctblock", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return true;
         }
-        if (vInv.size() > 0)
-            pfrom->PushMessage(NetMsgType::INV, vInv);
-    }
 
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+        int64_t nTimeStart = nodestate->nPartialBlockTime;
+        nMessageBytes += nodestate->nPartialBlockBytes;
+        nodestate->partialBlock.reset();
+        nodestate->hashPartialBlock = uint256(0);
 
-    else if (strCommand == NetMsgType::PING) {
-        if (pfrom->nVersion > BIP0031_VERSION) {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful features:
-            //
-            // 1) A remote node can quickly check if the connection is operational
-            // 2) Remote nodes can measure the latency of the network thread. If this node
-            //    is overloaded it won't respond to pings quickly and the remote node can
-            //    avoid sending us more work, like chain download requests.
-            //
-            // The nonce stops the remote getting confused between different pings: without
-            // it, if the remote node sends a ping once per second and this node takes 5
-            // seconds to respond to each, the 5th ping the remote sends would appear to
-            // return very quickly.
-            pfrom->PushMessage(NetMsgType::PONG, nonce);
+        ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("%s : invalid blocktxn %s from peer=%d", __func__, resp.blockhash.ToString(), pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Short id collision with one of our mempool transactions, get the block in full
+            compactBlockStats.nFallbacks++;
+            CInv inv(nodestate->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, resp.blockhash);
+            pfrom->PushMessage(NetMsgType::GETDATA, std::vector<CInv>(1, inv));
+            return true;
         }
+        compactBlockStats.nRoundTrips++;
+        compactBlockStats.nCompactBytes += nMessageBytes;
+        compactBlockStats.nBlockBytes += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        compactBlockStats.nReconstructMicros += GetTimeMicros() - nTimeStart;
     }
 
+    ProcessReceivedBlock(pfrom, block, strCommand);
+    MaybeSetPeerAsAnnouncingCmpctBlocks(pfrom, block.GetHash());
+    return true;
+}
+
+void GetCompactBlockStats(CCompactBlockStats& stats)
+{
+    LOCK(cs_main);
+    stats = compactBlockStats;
+}
 
-    else if (strCommand == NetMsgType::PONG) {
-        int64_t pingUsecEnd = nTimeReceived;
-        uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
+void GetServedBlockCacheStats(CServedBlockCacheStats& stats)
+{
+    LOCK(cs_main);
+    stats = servedBlockCacheStats;
+}
 
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
+// This asymmetric behavior for inbound and outbound connections was introduced
+// to prevent a fingerprinting attack: an attacker can send specific fake addresses
+// to users' AddrMan and later request them by sending getaddr messages.
+// Making users (which are behind NAT and can only make outgoing connections) ignore
+// getaddr message mitigates the attack.
+static bool ProcessGetAddrMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!pfrom->fInbound)
+        return true;
 
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
+    pfrom->vAddrToSend.clear();
+    vector<CAddress> vAddr = addrman.GetAddr();
+    for (const CAddress& addr : vAddr)
+        pfrom->PushAddress(addr);
+    return true;
+}
+
+static bool ProcessMempoolMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK2(cs_main, pfrom->cs_filter);
+
+    std::vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+    vector<CInv> vInv;
+    for (uint256& hash : vtxid) {
+        CInv inv(MSG_TX, hash);
+        CTransactionRef tx = mempool.get(hash);
+        if (!tx) continue; // another thread removed since queryHashes, maybe...
+        if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(*tx)) ||
+            (!pfrom->pfilter))
+            vInv.push_back(inv);
+        if (vInv.size() == MAX_INV_SZ) {
+            pfrom->PushMessage(NetMsgType::INV, vInv);
+            vInv.clear();
+        }
+    }
+    if (vInv.size() > 0)
+        pfrom->PushMessage(NetMsgType::INV, vInv);
+    return true;
+}
+
+static bool ProcessPingMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (pfrom->nVersion > BIP0031_VERSION) {
+        uint64_t nonce = 0;
+        vRecv >> nonce;
+        // Echo the message back with the nonce. This allows for two useful features:
+        //
+        // 1) A remote node can quickly check if the connection is operational
+        // 2) Remote nodes can measure the latency of the network thread. If this node
+        //    is overloaded it won't respond to pings quickly and the remote node can
+        //    avoid sending us more work, like chain download requests.
+        //
+        // The nonce stops the remote getting confused between different pings: without
+        // it, if the remote node sends a ping once per second and this node takes 5
+        // seconds to respond to each, the 5th ping the remote sends would appear to
+        // return very quickly.
+        pfrom->PushMessage(NetMsgType::PONG, nonce);
+    }
+    return true;
+}
+
+static bool ProcessPongMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
+
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
+
+        // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
                 } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere, cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
+                    // This should never happen
+                    sProblem = "Timing mishap";
                 }
             } else {
-                sProblem = "Unsolicited pong without ping";
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation somewhere, cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
+                }
             }
         } else {
-            // This is most likely a bug in another implementation somewhere, cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
+            sProblem = "Unsolicited pong without ping";
         }
+    } else {
+        // This is most likely a bug in another implementation somewhere, cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
 
-        if (!(sProblem.empty())) {
-            LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
-                pfrom->id,
-                pfrom->cleanSubVer,
-                sProblem,
-                pfrom->nPingNonceSent,
-                nonce,
-                nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
+    if (!(sProblem.empty())) {
+        LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
+            pfrom->id,
+            pfrom->cleanSubVer,
+            sProblem,
+            pfrom->nPingNonceSent,
+            nonce,
+            nAvail);
     }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
+    }
+    return true;
+}
 
-    else if (fAlerts && strCommand == NetMsgType::ALERT) {
-        CAlert alert;
-        vRecv >> alert;
+static bool ProcessAlertMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!fAlerts)
+        return true;
 
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0) {
-            if (alert.ProcessAlert()) {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
-                {
-                    LOCK(cs_vNodes);
-                    for (CNode* pnode : vNodes)
-                        alert.RelayTo(pnode);
-                }
-            } else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), 10);
+    CAlert alert;
+    vRecv >> alert;
+
+    uint256 alertHash = alert.GetHash();
+    if (pfrom->setKnown.count(alertHash) == 0) {
+        if (alert.ProcessAlert()) {
+            // Relay
+            pfrom->setKnown.insert(alertHash);
+            {
+                LOCK(cs_vNodes);
+                for (CNode* pnode : vNodes)
+                    alert.RelayTo(pnode);
             }
+        } else {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
         }
     }
+    return true;
+}
+
+/** Bloom filter commands are only allowed if we offer NODE_BLOOM; punishes pfrom otherwise */
+static bool CheckBloomAllowed(CNode* pfrom, const std::string& strCommand)
+{
+    if (nLocalServices & NODE_BLOOM)
+        return true;
+    LogPrintf("bloom message=%s\n", strCommand);
+    LOCK(cs_main);
+    Misbehaving(pfrom->GetId(), 100);
+    return false;
+}
 
-    else if (!(nLocalServices & NODE_BLOOM) &&
-                (strCommand == NetMsgType::FILTERLOAD ||
-                    strCommand == NetMsgType::FILTERADD ||
-                    strCommand == NetMsgType::FILTERCLEAR)) {
-        LogPrintf("bloom message=%s\n", strCommand);
+static bool ProcessFilterLoadMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomAllowed(pfrom, strCommand))
+        return true;
+
+    CBloomFilter filter;
+    vRecv >> filter;
+
+    if (!filter.IsWithinSizeConstraints()) {
+        // There is no excuse for sending a too-large filter
         LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter(filter);
+        pfrom->pfilter->UpdateEmptyFull();
     }
+    pfrom->fRelayTxes = true;
+    return true;
+}
+
+static bool ProcessFilterAddMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomAllowed(pfrom, strCommand))
+        return true;
 
-    else if (strCommand == NetMsgType::FILTERLOAD) {
-        CBloomFilter filter;
-        vRecv >> filter;
+    vector<unsigned char> vData;
+    vRecv >> vData;
 
-        if (!filter.IsWithinSizeConstraints()) {
-            // There is no excuse for sending a too-large filter
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+    // and thus, the maximum size any matched object can have) in a filteradd message
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter)
+            pfrom->pfilter->insert(vData);
+        else {
             LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
-        } else {
-            LOCK(pfrom->cs_filter);
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter(filter);
-            pfrom->pfilter->UpdateEmptyFull();
         }
-        pfrom->fRelayTxes = true;
     }
+    return true;
+}
 
+static bool ProcessFilterClearMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomAllowed(pfrom, strCommand))
+        return true;
 
-    else if (strCommand == NetMsgType::FILTERADD) {
-        vector<unsigned char> vData;
-        vRecv >> vData;
+    LOCK(pfrom->cs_filter);
+    delete pfrom->pfilter;
+    pfrom->pfilter = new CBloomFilter();
+    pfrom->fRelayTxes = true;
+    return true;
+}
 
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
-        // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100);
-        } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), 100);
+static bool ProcessFeeFilterMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CAmount newFeeFilter = 0;
+    vRecv >> newFeeFilter;
+    if (MoneyRange(newFeeFilter)) {
+        {
+            LOCK(pfrom->cs_feeFilter);
+            pfrom->minFeeFilter = newFeeFilter;
+        }
+        LogPrint("net", "received: feefilter of %s from peer=%d\n", CFeeRate(newFeeFilter).ToString(), pfrom->id);
+    }
+    return true;
+}
+
+static bool ProcessRejectMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (fDebug) {
+        try {
+            string strMsg;
+            unsigned char ccode;
+            string strReason;
+            vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+
+            ostringstream ss;
+            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+
+            if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX) {
+                uint256 hash;
+                vRecv >> hash;
+                ss << ": hash " << hash.ToString();
             }
+            LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
+        } catch (std::ios_base::failure& e) {
+            // Avoid feedback loops by preventing reject messages from triggering a new reject message.
+            LogPrint("net", "Unparseable reject message received\n");
         }
     }
+    return true;
+}
 
+static bool ProcessMasternodeManMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
 
-    else if (strCommand == NetMsgType::FILTERCLEAR) {
-        LOCK(pfrom->cs_filter);
-        delete pfrom->pfilter;
-        pfrom->pfilter = new CBloomFilter();
-        pfrom->fRelayTxes = true;
-    }
+static bool ProcessBudgetMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    budget.ProcessMessage(pfrom, strCommand, vRecv);
+    return true;
+}
 
+static bool ProcessMasternodePaymentsMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    return true;
+}
 
-    else if (strCommand == NetMsgType::REJECT) {
-        if (fDebug) {
-            try {
-                string strMsg;
-                unsigned char ccode;
-                string strReason;
-                vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
-
-                ostringstream ss;
-                ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
-
-                if (strMsg == NetMsgType::BLOCK || strMsg == NetMsgType::TX) {
-                    uint256 hash;
-                    vRecv >> hash;
-                    ss << ": hash " << hash.ToString();
-                }
-                LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
-            } catch (std::ios_base::failure& e) {
-                // Avoid feedback loops by preventing reject messages from triggering a new reject message.
-                LogPrint("net", "Unparseable reject message received\n");
-            }
-        }
-    } else {
-        //probably one the extensions
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
-    }
+static bool ProcessSwiftTXMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
+    return true;
+}
 
+static bool ProcessSporkMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    ProcessSpork(pfrom, strCommand, vRecv);
+    return true;
+}
 
+static bool ProcessMasternodeSyncMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
     return true;
 }
 
+namespace
+{
+typedef bool (*MessageHandlerFn)(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
+
+struct CMessageHandler {
+    MessageHandlerFn fn;
+    uint64_t nCount;
+    uint64_t nFailed;
+    int64_t nTimeMicros;
+    int64_t nMaxTimeMicros;
+    int64_t nQueueMicros;
+    int64_t nMaxQueueMicros;
+
+    CMessageHandler() : fn(NULL), nCount(0), nFailed(0), nTimeMicros(0), nMaxTimeMicros(0), nQueueMicros(0), nMaxQueueMicros(0) {}
+};
+
+typedef boost::unordered_map<std::string, CMessageHandler> MessageHandlerMap;
+
+void RegisterMessageHandler(MessageHandlerMap& mapHandlers, const char* pszCommand, MessageHandlerFn fn)
+{
+    CMessageHandler& handler = mapHandlers[pszCommand];
+    assert(handler.fn == NULL); // each command has exactly one handler
+    handler.fn = fn;
+}
+
+MessageHandlerMap CreateMessageHandlers()
+{
+    MessageHandlerMap mapHandlers;
+    RegisterMessageHandler(mapHandlers, NetMsgType::VERSION, ProcessVersionMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::VERACK, ProcessVerackMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::ADDR, ProcessAddrMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::INV, ProcessInvMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETDATA, ProcessGetDataMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETBLOCKS, ProcessGetBlocksMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETHEADERS, ProcessGetHeadersMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::HEADERS, ProcessHeadersMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::TX, ProcessTxMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::DSTX, ProcessTxMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::BLOCK, ProcessBlockMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::SENDCMPCT, ProcessSendCmpctMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::CMPCTBLOCK, ProcessCmpctBlockMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETBLOCKTXN, ProcessGetBlockTxnMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::BLOCKTXN, ProcessBlockTxnMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETADDR, ProcessGetAddrMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MEMPOOL, ProcessMempoolMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::PING, ProcessPingMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::PONG, ProcessPongMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::ALERT, ProcessAlertMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FILTERLOAD, ProcessFilterLoadMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FILTERADD, ProcessFilterAddMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FILTERCLEAR, ProcessFilterClearMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FEEFILTER, ProcessFeeFilterMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::REJECT, ProcessRejectMessage);
+
+    // masternode, budget, swiftx and spork extensions
+    RegisterMessageHandler(mapHandlers, NetMsgType::MNB, ProcessMasternodeManMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MNP, ProcessMasternodeManMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::DSEG, ProcessMasternodeManMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MNVS, ProcessBudgetMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MPROP, ProcessBudgetMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MVOTE, ProcessBudgetMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FBS, ProcessBudgetMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::FBVOTE, ProcessBudgetMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MNGET, ProcessMasternodePaymentsMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::MNW, ProcessMasternodePaymentsMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::IX, ProcessSwiftTXMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::TXLVOTE, ProcessSwiftTXMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::SPORK, ProcessSporkMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::GETSPORKS, ProcessSporkMessage);
+    RegisterMessageHandler(mapHandlers, NetMsgType::SSC, ProcessMasternodeSyncMessage);
+    return mapHandlers;
+}
+
+/** Handler table, keyed by command. Built once; the statistics are guarded by cs_messageHandlers. */
+MessageHandlerMap mapMessageHandlers = CreateMessageHandlers();
+CCriticalSection cs_messageHandlers;
+bool CompareMessageHandlerStatsByCommand(const CMessageHandlerStats& a, const CMessageHandlerStats& b)
+{
+    return a.strCommand < b.strCommand;
+}
+} // anon namespace
+
+void GetMessageHandlerStats(std::vector<CMessageHandlerStats>& vStats)
+{
+    vStats.clear();
+    LOCK(cs_messageHandlers);
+    for (const std::pair<const std::string, CMessageHandler>& item : mapMessageHandlers) {
+        CMessageHandlerStats stats;
+        stats.strCommand = item.first;
+        stats.nCount = item.second.nCount;
+        stats.nFailed = item.second.nFailed;
+        stats.nTimeMicros = item.second.nTimeMicros;
+        stats.nMaxTimeMicros = item.second.nMaxTimeMicros;
+        stats.nQueueMicros = item.second.nQueueMicros;
+        stats.nMaxQueueMicros = item.second.nMaxQueueMicros;
+        vStats.push_back(stats);
+    }
+    std::sort(vStats.begin(), vStats.end(), CompareMessageHandlerStatsByCommand);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0) {
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
+    }
+
+    if (pfrom->nVersion == 0 && strCommand != NetMsgType::VERSION) {
+        // Must have a version message before anything else
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
+    }
+
+    MessageHandlerMap::iterator it = mapMessageHandlers.find(strCommand);
+    if (it == mapMessageHandlers.end()) {
+        LogPrint("net", "Unknown message %s peer=%d\n", SanitizeString(strCommand), pfrom->id);
+        return true;
+    }
+
+    int64_t nTimeStart = GetTimeMicros();
+    bool fRet = it->second.fn(pfrom, strCommand, vRecv, nTimeReceived);
+    int64_t nTimeElapsed = GetTimeMicros() - nTimeStart;
+    // Time the message spent between arriving off the wire and being dispatched
+    int64_t nTimeQueued = std::max(nTimeStart - nTimeReceived, (int64_t)0);
+    {
+        LOCK(cs_messageHandlers);
+        CMessageHandler& handler = it->second;
+        handler.nCount++;
+        if (!fRet)
+            handler.nFailed++;
+        handler.nTimeMicros += nTimeElapsed;
+        handler.nMaxTimeMicros = std::max(handler.nMaxTimeMicros, nTimeElapsed);
+        handler.nQueueMicros += nTimeQueued;
+        handler.nMaxQueueMicros = std::max(handler.nMaxQueueMicros, nTimeQueued);
+    }
+    return fRet;
+}
+
 // Note: whenever a protocol update is needed toggle between both implementations (comment out the formerly active one)
 //       so we can leave the existing clients untouched (old SPORK will stay on so they don't see even older clients).
 //       Those old clients won't react to the changes of the other (new) SPORK because at the time of their implementation
@@ -5992,9 +6945,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6011,7 +6964,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend) {
                 // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6053,10 +7007,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (pto->nVersion >= HEADERS_FIRST_VERSION && Params().HeadersFirstSyncingActive()) {
+                    // Headers first, the blocks are then fetched from every peer that has them
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
@@ -6071,15 +7029,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
+        vector<CInv> vInvPriority;
         vector<CInv> vInvWait;
+        CAmount filterrate = 0;
+        {
+            LOCK(pto->cs_feeFilter);
+            filterrate = pto->minFeeFilter;
+        }
+        uint64_t nFeeFiltered = 0;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             for (const CInv& inv : pto->vInventoryToSend) {
-                if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && pto->setInventoryKnown.count(inv))
+                if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && pto->filterInventoryKnown.contains(inv.GetKey()))
                     continue;
 
+                // The peer would not accept it anyway, see feefilter
+                if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && filterrate) {
+                    CFeeRate feeRate;
+                    if (mempool.lookupFeeRate(inv.hash, feeRate) && feeRate.GetFeePerK() < filterrate) {
+                        nFeeFiltered++;
+                        continue;
+                    }
+                }
+
                 // trickle out tx inv to protect privacy
                 if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && !fSendTrickle) {
                     // 1/4 of tx invs blast to all immediately
@@ -6097,7 +7071,18 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 }
 
                 // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                std::vector<unsigned char> vKey(inv.GetKey());
+                if (!pto->filterInventoryKnown.contains(vKey)) {
+                    pto->filterInventoryKnown.insert(vKey);
+                    // New blocks and masternode votes are announced ahead of whatever the peer is downloading
+                    if (inv.type == MSG_BLOCK || inv.type == MSG_MASTERNODE_WINNER || inv.type == MSG_TXLOCK_VOTE) {
+                        vInvPriority.push_back(inv);
+                        if (vInvPriority.size() >= 1000) {
+                            pto->PushMessageWithClass(SEND_CLASS_PRIORITY, NetMsgType::INV, vInvPriority);
+                            vInvPriority.clear();
+                        }
+                        continue;
+                    }
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage(NetMsgType::INV, vInv);
@@ -6107,8 +7092,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->vInventoryToSend = vInvWait;
         }
+        if (!vInvPriority.empty())
+            pto->PushMessageWithClass(SEND_CLASS_PRIORITY, NetMsgType::INV, vInvPriority);
         if (!vInv.empty())
             pto->PushMessage(NetMsgType::INV, vInv);
+        if (nFeeFiltered) {
+            LOCK(pto->cs_feeFilter);
+            pto->nFeeFilteredInvs += nFeeFiltered;
+        }
 
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
@@ -6133,13 +7124,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nMaxBlocksInTransit = Params().HeadersFirstSyncingActive() ? MAX_BLOCKS_IN_TRANSIT_PER_PEER : MAX_BLOCKS_IN_TRANSIT_PER_PEER_LEGACY;
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < nMaxBlocksInTransit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), nMaxBlocksInTransit - state.nBlocksInFlight, vToDownload, staller);
             for (CBlockIndex *pindex : vToDownload) {
-                if (State(pto->GetId())->fHaveWitness || GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) > pindex->pprev->nTime) {
-                    vGetData.push_back(CInv(State(staller)->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
+                if (state.fHaveWitness || GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) > pindex->pprev->nTime) {
+                    vGetData.push_back(CInv(state.fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                     MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                     LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                         pindex->nHeight, pto->id);
@@ -6171,6 +7163,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
         if (!vGetData.empty())
             pto->PushMessage(NetMsgType::GETDATA, vGetData);
+
+        //
+        // Message: feefilter
+        //
+        if (!pto->fDisconnect && pto->nVersion >= FEEFILTER_VERSION && GetBoolArg("-feefilter", DEFAULT_FEEFILTER)) {
+            // Transactions announced while we are still syncing would only be thrown away
+            CAmount currentFilter = IsInitialBlockDownload() ? Params().MaxMoneyOut() : ::minRelayTxFee.GetFeePerK();
+            if (nNow > pto->nextSendTimeFeeFilter) {
+                if (currentFilter != pto->lastSentFeeFilter) {
+                    pto->PushMessage(NetMsgType::FEEFILTER, currentFilter);
+                    pto->lastSentFeeFilter = currentFilter;
+                }
+                pto->nextSendTimeFeeFilter = nNow + GetRand(2 * AVG_FEEFILTER_BROADCAST_INTERVAL * 1000000LL);
+            } else if (nNow + MAX_FEEFILTER_CHANGE_DELAY * 1000000LL < pto->nextSendTimeFeeFilter &&
+                       (currentFilter < 3 * pto->lastSentFeeFilter / 4 || currentFilter > 4 * pto->lastSentFeeFilter / 3)) {
+                // Only a significant change is worth sending ahead of schedule, and then still after a random delay
+                pto->nextSendTimeFeeFilter = nNow + GetRand(MAX_FEEFILTER_CHANGE_DELAY * 1000000LL);
+            }
+        }
     }
     return true;
 }
@@ -6248,7 +7259,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.Clear();
     }
 } instance_of_cmaincleanup;
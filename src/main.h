@@ -45,6 +45,7 @@
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
+class CBlockPrefetcher;
 class CBlockTreeDB;
 class CSporkDB;
 class CBloomFilter;
@@ -82,6 +83,8 @@ static const int64_t MAX_BLOCK_COST = 4000000;
 static const unsigned int MAX_BLOCK_BASE_SIZE = 1000000;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum size in kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 500;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -94,13 +97,38 @@ static const int COINBASE_MATURITY = 50;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 1024;
+/** -mempoolparallelinputs default (minimum inputs for a mempool transaction to use the script-checking threads, 0 = never) */
+static const unsigned int DEFAULT_MEMPOOL_PARALLEL_INPUTS = 32;
+/** -compactblocks default (relay blocks to and from peers as cmpctblock) */
+static const bool DEFAULT_COMPACT_BLOCKS = true;
+/** -compactblockshb default (ask peers to push new blocks as cmpctblock without an inv round-trip) */
+static const bool DEFAULT_COMPACT_BLOCKS_HB = false;
+/** Number of peers asked to announce new blocks in high-bandwidth compact mode */
+static const unsigned int MAX_COMPACT_BLOCKS_HB_PEERS = 3;
+/** Only serve cmpctblock and blocktxn for blocks this close to the tip, older ones are sent in full */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+/** Number of recently served blocks kept serialized to answer getdata from other peers */
+static const unsigned int MAX_SERVED_BLOCK_CACHE_SIZE = 8;
+/** -feefilter default (tell peers not to announce transactions below our minimum relay fee rate) */
+static const bool DEFAULT_FEEFILTER = true;
+/** Average delay between feefilter broadcasts in seconds. */
+static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
+/** Maximum feefilter broadcast delay after a significant change of our minimum fee rate, in seconds. */
+static const unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
+/** Number of blocks that can be requested at any given time from a single peer during headers-first
+ *  sync. Small against BLOCK_DOWNLOAD_WINDOW so the window is spread over many peers; the
+ *  BLOCK_STALLING_TIMEOUT only runs while a peer holds back the start of the window and another peer
+ *  has nothing left to fetch. */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks that can be requested at any given time from a single peer without headers-first sync. */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_LEGACY = 1024;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of headers messages in a row that do not connect to our block index after which a peer is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -140,6 +168,7 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern unsigned int nMempoolParallelInputs;
 extern bool fTxIndex;
 extern bool fAddrIndex;
 extern bool fIsBareMultisigStd;
@@ -174,7 +203,7 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
-void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+void SyncWithWallets(const CTransactionRef& tx, const CBlock* pblock = NULL);
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -222,6 +251,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking the transactions of large blocks */
+void ThreadBlockCheck();
+/** Size the cache of transactions whose scripts passed, from -maxsigcachesize */
+void InitScriptExecutionCache();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -258,7 +291,7 @@ void FlushStateToDisk();
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -399,7 +432,10 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
  * instead of being performed inline.
  */
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks = NULL);
+
+/** Script verification flags ConnectBlock applies to a block with time nBlockTime */
+unsigned int GetBlockScriptFlags(int64_t nBlockTime);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
@@ -447,6 +483,76 @@ public:
 };
 
 
+/** Script verification statistics of AcceptToMemoryPool, reported by getmempoolinfo */
+struct CMempoolScriptStats {
+    uint64_t nSerialTx;
+    uint64_t nSerialInputs;
+    int64_t nSerialMicros;
+    uint64_t nParallelTx;
+    uint64_t nParallelInputs;
+    int64_t nParallelMicros;
+
+    CMempoolScriptStats() : nSerialTx(0), nSerialInputs(0), nSerialMicros(0), nParallelTx(0), nParallelInputs(0), nParallelMicros(0) {}
+};
+
+/** Get a copy of the mempool script verification statistics */
+void GetMempoolScriptStats(CMempoolScriptStats& stats);
+
+/** Statistics of a single P2P command handler, reported by getmessagestats */
+struct CMessageHandlerStats {
+    std::string strCommand;
+    uint64_t nCount;
+    uint64_t nFailed;
+    int64_t nTimeMicros;
+    int64_t nMaxTimeMicros;
+    //! Time from a message being fully received until its handler ran
+    int64_t nQueueMicros;
+    int64_t nMaxQueueMicros;
+};
+
+/** Get the statistics of every registered P2P command handler, sorted by command */
+void GetMessageHandlerStats(std::vector<CMessageHandlerStats>& vStats);
+
+/** Compact block relay statistics, reported by getcompactblockstats */
+struct CCompactBlockStats {
+    //! cmpctblock messages sent to peers, either announced or requested
+    uint64_t nSent;
+    //! cmpctblock messages received for blocks we did not have yet
+    uint64_t nReceived;
+    //! Blocks rebuilt from the mempool without asking for missing transactions
+    uint64_t nReconstructed;
+    //! Blocks rebuilt after a getblocktxn round-trip
+    uint64_t nRoundTrips;
+    //! Blocks we had to request in full (short id collisions)
+    uint64_t nFallbacks;
+    //! Bytes of cmpctblock and blocktxn messages received for rebuilt blocks
+    uint64_t nCompactBytes;
+    //! Serialized size of the rebuilt blocks
+    uint64_t nBlockBytes;
+    //! Time from receiving the cmpctblock until the block was rebuilt
+    int64_t nReconstructMicros;
+
+    CCompactBlockStats() : nSent(0), nReceived(0), nReconstructed(0), nRoundTrips(0), nFallbacks(0), nCompactBytes(0), nBlockBytes(0), nReconstructMicros(0) {}
+};
+
+/** Get a copy of the compact block relay statistics */
+void GetCompactBlockStats(CCompactBlockStats& stats);
+
+/** Statistics of the cache of serialized blocks served to peers, reported by getnettotals */
+struct CServedBlockCacheStats {
+    //! Block requests answered from the cache
+    uint64_t nHits;
+    //! Block requests that had to read and serialize the block
+    uint64_t nMisses;
+    //! Bytes sent from the cache without reading the block from disk
+    uint64_t nHitBytes;
+
+    CServedBlockCacheStats() : nHits(0), nMisses(0), nHitBytes(0) {}
+};
+
+/** Get a copy of the served block cache statistics */
+void GetServedBlockCacheStats(CServedBlockCacheStats& stats);
+
 /**
  * Closure representing one script verification
  * Note that this stores references to the spending transaction
@@ -461,12 +567,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    PrecomputedTransactionData *txdata;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(NULL) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
@@ -479,6 +586,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -522,6 +630,12 @@ bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
 bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+/**
+ * Check a sequence of connected headers and add them to the block index. Headers that do not lead
+ * to more work than the active chain are not added. ppindex, if set, receives the index entry of
+ * the last header accepted.
+ */
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 bool RewindBlockIndex(const CChainParams& params);
 
@@ -614,6 +728,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Reads blocks ahead of ConnectTip, or NULL with -blockprefetch=0 */
+extern CBlockPrefetcher* pblockprefetcher;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
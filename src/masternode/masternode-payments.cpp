@@ -285,7 +285,7 @@ bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight)
         return true;
     }
 
-    const CTransaction& txNew = (nBlockHeight > Params().LAST_POW_BLOCK() ? block.vtx[1] : block.vtx[0]);
+    const CTransaction& txNew = (nBlockHeight > Params().LAST_POW_BLOCK() ? *block.vtx[1] : *block.vtx[0]);
 
     //check if it's a budget block
     if (IsSporkActive(SPORK_11_ENABLE_SUPERBLOCKS)) {
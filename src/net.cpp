@@ -20,9 +20,11 @@
 #include "clientversion.h"
 #include "miner.h"
 #include "obfuscation.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "protocol.h"
 #include "scheduler.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 
 #ifdef WIN32
@@ -39,6 +41,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -65,6 +68,8 @@ using namespace std;
 namespace
 {
     const int MAX_OUTBOUND_CONNECTIONS = 16;
+    //! Outbound connection attempts ThreadOpenConnections keeps in flight at once
+    const int MAX_PARALLEL_CONNECTS = 8;
 
     struct ListenSocket {
         SOCKET socket;
@@ -95,7 +100,7 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsg> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -113,7 +118,27 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+// Outbound connection attempts handed from ThreadOpenConnections to ThreadOpenConnectionAttempts
+struct COutboundAttempt {
+    CAddress addr;
+    boost::shared_ptr<CSemaphoreGrant> grantOutbound;
+    boost::shared_ptr<CSemaphoreGrant> grantAttempt;
+};
+static CSemaphore* semConnectAttempts = NULL;
+static boost::mutex mutexConnectAttempts;
+static boost::condition_variable connectAttemptsCondition;
+static std::deque<COutboundAttempt> vConnectAttempts;
+//! Network groups of queued or running attempts, so no two go to the same group
+static std::multiset<std::vector<unsigned char> > setConnectingGroups;
+//! Start of ThreadOpenConnections, and the outbound peer count last logged (cs_vNodes)
+static int64_t nOpenConnectionsStartMillis = 0;
+static int nOutboundLogged = 0;
+
+// Nodes with work for ThreadMessageHandler
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable messageHandlerCondition;
+static std::set<NodeId> setMessageHandlerReady;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -346,6 +371,14 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+CSendPathStats CNode::sendPathStats;
+CSendLatencyStats CNode::sendLatencyStats[SEND_CLASS_COUNT];
+mapMsgCmdTotals CNode::mapTotalSendPerMsgCmd;
+mapMsgCmdTotals CNode::mapTotalRecvPerMsgCmd;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -702,6 +735,20 @@ void CNode::copyStats(CNodeStats& stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    stats.nKnownFilterBytes = addrKnown.GetMemoryUsage() + filterInventoryKnown.GetMemoryUsage();
+    {
+        LOCK(cs_feeFilter);
+        X(minFeeFilter);
+        X(nFeeFilteredInvs);
+    }
+    {
+        LOCK(cs_totalBytesSent);
+        X(mapSendPerMsgCmd);
+    }
+    {
+        LOCK(cs_totalBytesRecv);
+        X(mapRecvPerMsgCmd);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -754,7 +801,20 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+
+            // Keep the per-type counters bounded by accounting unknown types together
+            mapMsgCmdTotals::iterator i = mapRecvPerMsgCmd.find(msg.hdr.GetCommand());
+            if (i == mapRecvPerMsgCmd.end())
+                i = mapRecvPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+            assert(i != mapRecvPerMsgCmd.end());
+            uint64_t nMsgBytes = msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            {
+                LOCK(cs_totalBytesRecv);
+                i->second.Add(nMsgBytes);
+                mapTotalRecvPerMsgCmd[i->first].Add(nMsgBytes);
+            }
+
+            WakeMessageHandler(id);
         }
     }
 
@@ -809,24 +869,66 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
+/** Most queued messages handed to the kernel in one send call */
+static const int MAX_SEND_BUFFERS_PER_CALL = 64;
+
+/** Write the queued messages starting at it, the first one from nOffset on, in as few system calls as possible */
+static int SendQueuedMessages(SOCKET hSocket, std::deque<CQueuedNetMsg>::const_iterator it, std::deque<CQueuedNetMsg>::const_iterator itEnd, size_t nOffset)
+{
+#ifdef WIN32
+    const CSerializeData& data = *it->msg;
+    int nBytes = send(hSocket, &data[nOffset], data.size() - nOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    CNode::RecordSendCall(1);
+    return nBytes;
+#else
+    struct iovec vIov[MAX_SEND_BUFFERS_PER_CALL];
+    int nBuffers = 0;
+    for (; it != itEnd && nBuffers < MAX_SEND_BUFFERS_PER_CALL; ++it) {
+        const CSerializeData& data = *it->msg;
+        vIov[nBuffers].iov_base = (void*)&data[nOffset];
+        vIov[nBuffers].iov_len = data.size() - nOffset;
+        nOffset = 0;
+        nBuffers++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vIov;
+    msg.msg_iovlen = nBuffers;
+    int nBytes = sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    CNode::RecordSendCall(nBuffers);
+    return nBytes;
+#endif
+}
+
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    // ProcessMessages leaves messages queued while the send buffer is full
+    bool fSendBufferFull = pnode->nSendSize >= SendBufferSize();
+    std::deque<CQueuedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert(it->msg->size() > pnode->nSendOffset);
+        int nBytes = SendQueuedMessages(pnode->hSocket, it, pnode->vSendMsg.end(), pnode->nSendOffset);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Retire the messages that went out completely
+            int64_t nNow = GetTimeMicros();
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nMsgSize = it->msg->size();
+                if (nLeft < nMsgSize - pnode->nSendOffset) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nMsgSize - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= nMsgSize;
+                CNode::RecordSendLatency(it->sendClass, nNow - it->nTimeQueued);
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -849,12 +951,23 @@ void SocketSendData(CNode* pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    if (fSendBufferFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler(pnode->id);
 }
 
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
 {
+    boost::scoped_ptr<CSocketEvents> pSocketEvents(CreateSocketEvents(GetArg("-socketevents", DEFAULT_SOCKETEVENTS)));
+    if (!pSocketEvents) {
+        // -socketevents was validated at startup; only a failing epoll_create1() can get us here
+        LogPrintf("ThreadSocketHandler: socket events backend unavailable, falling back to select\n");
+        pSocketEvents.reset(new CSelectSocketEvents());
+    }
+    LogPrint("net", "ThreadSocketHandler: using %s\n", pSocketEvents->GetName());
+
     unsigned int nPrevNodeCount = 0;
     while (true) {
         //
@@ -921,42 +1034,25 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        int64_t nTimeoutMs = 50; // frequency to poll pnode->vSend
 
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        for (const ListenSocket& hListenSocket : vhListenSocket)
+            pSocketEvents->Add(hListenSocket.socket, SOCKET_EVENT_RECV, -1);
 
         {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
 
                 // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
+                // * If there is data to send, wait for sending data. As this only
                 //   happens when optimistic write failed, we choose to first drain the
                 //   write buffer in this case before receiving more. This avoids
                 //   needlessly queueing received data, if the remote peer is not themselves
                 //   receiving data. This means properly utilizing TCP flow control signalling.
                 // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
+                //   or there is space left in the buffer, wait for receiving data.
                 // * (if neither of the above applies, there is certainly one message
                 //   in the receiver buffer ready to be processed).
                 // Together, that means that at least one of the following is always possible,
@@ -964,43 +1060,36 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                unsigned int nEvents = SOCKET_EVENT_ERR;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        nEvents |= SOCKET_EVENT_SEND;
                 }
-                {
+                if (!(nEvents & SOCKET_EVENT_SEND)) {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                     if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
                                      pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                        nEvents |= SOCKET_EVENT_RECV;
                 }
+                pSocketEvents->Add(pnode->hSocket, nEvents, pnode->id);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        bool fWaitOk = pSocketEvents->Wait(nTimeoutMs);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
+        if (!fWaitOk) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket %s error %s\n", pSocketEvents->GetName(), NetworkErrorString(nErr));
+            MilliSleep(nTimeoutMs);
         }
 
         //
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && (pSocketEvents->GetEvents(hListenSocket.socket) & SOCKET_EVENT_RECV)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1023,7 +1112,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!pSocketEvents->IsSupported(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1063,7 +1152,8 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            unsigned int nEvents = pSocketEvents->GetEvents(pnode->hSocket);
+            if (nEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
@@ -1099,7 +1189,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (nEvents & SOCKET_EVENT_SEND) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     SocketSendData(pnode);
@@ -1243,6 +1333,22 @@ void MapPort(bool)
 #endif
 
 
+static void LookupDNSSeed(const CDNSSeedData& seed, int* pFound)
+{
+    vector<CNetAddr> vIPs;
+    vector<CAddress> vAdd;
+    if (LookupHost(seed.host.c_str(), vIPs, 256, true)) {
+        for (CNetAddr& ip : vIPs) {
+            int nOneDay = 24 * 3600;
+            CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+            addr.nTime = GetTime() - 3 * nOneDay - GetRand(4 * nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+    addrman.Add(vAdd, CNetAddr(seed.name));
+    *pFound = vAdd.size();
+}
+
 void ThreadDNSAddressSeed()
 {
     // goal: only query DNS seeds if address need is acute
@@ -1258,30 +1364,31 @@ void ThreadDNSAddressSeed()
     }
 
     const vector<CDNSSeedData>& vSeeds = Params().DNSSeeds();
-    int found = 0;
+    int64_t nStart = GetTimeMillis();
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
-    for (const CDNSSeedData& seed : vSeeds) {
-        if (HaveNameProxy()) {
-            AddOneShot(seed.host);
-        } else {
-            vector<CNetAddr> vIPs;
-            vector<CAddress> vAdd;
-            if (LookupHost(seed.host.c_str(), vIPs, 256, true)) {
-                for (CNetAddr& ip : vIPs) {
-                    int nOneDay = 24 * 3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3 * nOneDay - GetRand(4 * nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
-            }
-            addrman.Add(vAdd, CNetAddr(seed.name));
-        }
+    // Resolve all seeds at once, a slow or dead seed should not hold up the others
+    vector<int> vFound(vSeeds.size(), 0);
+    boost::thread_group lookupThreads;
+    for (size_t i = 0; i < vSeeds.size(); i++) {
+        if (HaveNameProxy())
+            AddOneShot(vSeeds[i].host);
+        else
+            lookupThreads.create_thread(boost::bind(&LookupDNSSeed, boost::cref(vSeeds[i]), &vFound[i]));
+    }
+    try {
+        lookupThreads.join_all();
+    } catch (const boost::thread_interrupted&) {
+        // The lookups write to vFound, wait for them before unwinding
+        lookupThreads.join_all();
+        throw;
     }
 
-    LogPrintf("%d addresses found from DNS seeds\n", found);
+    int found = 0;
+    for (int nFound : vFound)
+        found += nFound;
+    LogPrintf("%d addresses found from DNS seeds in %dms\n", found, GetTimeMillis() - nStart);
 }
 
 
@@ -1339,12 +1446,18 @@ void ThreadOpenConnections()
 
     // Initiate network connections
     int64_t nStart = GetTime();
+    {
+        LOCK(cs_vNodes);
+        nOpenConnectionsStartMillis = GetTimeMillis();
+    }
     while (true) {
         ProcessOneShot();
 
         MilliSleep(500);
 
-        CSemaphoreGrant grant(*semOutbound);
+        // Attempts run in ThreadOpenConnectionAttempts, so a dead address only holds up one of them
+        boost::shared_ptr<CSemaphoreGrant> grant(new CSemaphoreGrant(*semOutbound));
+        boost::shared_ptr<CSemaphoreGrant> grantAttempt(new CSemaphoreGrant(*semConnectAttempts));
         boost::this_thread::interruption_point();
 
         // Add seed nodes if DNS seeds are all down (an infrastructure attack?).
@@ -1375,6 +1488,10 @@ void ThreadOpenConnections()
                 }
             }
         }
+        {
+            boost::lock_guard<boost::mutex> lock(mutexConnectAttempts);
+            setConnected.insert(setConnectingGroups.begin(), setConnectingGroups.end());
+        }
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1416,8 +1533,55 @@ void ThreadOpenConnections()
             break;
         }
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        if (addrConnect.IsValid()) {
+            COutboundAttempt attempt;
+            attempt.addr = addrConnect;
+            attempt.grantOutbound = grant;
+            attempt.grantAttempt = grantAttempt;
+            {
+                boost::lock_guard<boost::mutex> lock(mutexConnectAttempts);
+                setConnectingGroups.insert(addrConnect.GetGroup());
+                vConnectAttempts.push_back(attempt);
+            }
+            connectAttemptsCondition.notify_one();
+        }
+    }
+}
+
+/** Log how long after startup the number of outbound peers first reached 1, 2, 4, ... */
+static void LogOutboundPeersReached()
+{
+    LOCK(cs_vNodes);
+    int nOutbound = 0;
+    for (CNode* pnode : vNodes)
+        if (!pnode->fInbound)
+            nOutbound++;
+    while (nOutbound > nOutboundLogged) {
+        nOutboundLogged = nOutboundLogged ? 2 * nOutboundLogged : 1;
+        if (nOutbound >= nOutboundLogged)
+            LogPrintf("Connected to %d outbound peers %dms after startup\n", nOutboundLogged, GetTimeMillis() - nOpenConnectionsStartMillis);
+    }
+}
+
+void ThreadOpenConnectionAttempts()
+{
+    while (true) {
+        COutboundAttempt attempt;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexConnectAttempts);
+            while (vConnectAttempts.empty())
+                connectAttemptsCondition.wait(lock);
+            attempt = vConnectAttempts.front();
+            vConnectAttempts.pop_front();
+        }
+
+        bool fConnected = OpenNetworkConnection(attempt.addr, attempt.grantOutbound.get());
+        {
+            boost::lock_guard<boost::mutex> lock(mutexConnectAttempts);
+            setConnectingGroups.erase(setConnectingGroups.find(attempt.addr.GetGroup()));
+        }
+        if (fConnected)
+            LogOutboundPeersReached();
     }
 }
 
@@ -1518,29 +1682,48 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+void WakeMessageHandler(NodeId id)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+        if (!setMessageHandlerReady.insert(id).second)
+            return;
+    }
+    messageHandlerCondition.notify_one();
+}
 
+void ThreadMessageHandler()
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64_t nNextSendSweep = 0;
     while (true) {
+        // Wait until a node becomes ready or the next send sweep is due
+        std::set<NodeId> setReady;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            int64_t nWait = nNextSendSweep - GetTimeMillis();
+            if (setMessageHandlerReady.empty() && nWait > 0)
+                messageHandlerCondition.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            setReady.swap(setMessageHandlerReady);
+        }
+        bool fSendSweep = GetTimeMillis() >= nNextSendSweep;
+        if (fSendSweep)
+            nNextSendSweep = GetTimeMillis() + MESSAGE_HANDLER_SEND_INTERVAL;
+
+        // The sweep visits every node, which also catches any work whose wakeup was missed
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
+            for (CNode* pnode : vNodes) {
+                if (fSendSweep || setReady.count(pnode->id))
+                    vNodesCopy.push_back(pnode->AddRef());
             }
         }
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fSendSweep && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
         for (CNode* pnode : vNodesCopy) {
             if (pnode->fDisconnect)
                 continue;
@@ -1552,11 +1735,15 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // ProcessMessages handles one message per call; come back for the rest
                     if (pnode->nSendSize < SendBufferSize()) {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
-                            fSleep = false;
+                            WakeMessageHandler(pnode->id);
                         }
                     }
+                } else if (setReady.count(pnode->id)) {
+                    // The socket thread only holds the lock briefly, retry rather than wait for the sweep
+                    WakeMessageHandler(pnode->id);
                 }
             }
             boost::this_thread::interruption_point();
@@ -1566,6 +1753,8 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                else if (setReady.count(pnode->id))
+                    WakeMessageHandler(pnode->id);
             }
             boost::this_thread::interruption_point();
         }
@@ -1576,9 +1765,6 @@ void ThreadMessageHandler()
             for (CNode* pnode : vNodesCopy)
             pnode->Release();
         }
-
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
@@ -1743,6 +1929,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
         int nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections);
         semOutbound = new CSemaphore(nMaxOutbound);
     }
+    if (semConnectAttempts == NULL)
+        semConnectAttempts = new CSemaphore(MAX_PARALLEL_CONNECTS);
 
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
@@ -1769,6 +1957,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
+    for (int i = 0; i < MAX_PARALLEL_CONNECTS; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "conattempt", &ThreadOpenConnectionAttempts));
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
@@ -1784,6 +1974,9 @@ bool StopNode()
     if (semOutbound)
         for (int i = 0; i < MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    if (semConnectAttempts)
+        for (int i = 0; i < MAX_PARALLEL_CONNECTS; i++)
+            semConnectAttempts->post();
 
     if (fAddressesInitialized) {
         DumpData();
@@ -1817,8 +2010,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+        vConnectAttempts.clear();
         delete semOutbound;
         semOutbound = NULL;
+        delete semConnectAttempts;
+        semConnectAttempts = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
@@ -1838,17 +2034,14 @@ void CExplicitNetCleanup::callCleanup()
 }
 
 void RelayTransaction(const CTransaction& tx)
-{
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
+    CInv invWitness(MSG_WITNESS_TX, tx.GetHash());
     {
+        // Serialize once for every peer that will ask for it, with and without witness
+        CSerializedNetMsg msg = CreateSerializedNetMsg(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, tx);
+        CSerializedNetMsg msgWitness = tx.wit.IsNull() ? msg : CreateSerializedNetMsg(0, NetMsgType::TX, tx);
+
         LOCK(cs_mapRelay);
         // Expire old relay messages
         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
@@ -1856,9 +2049,10 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
+        mapRelay.insert(std::make_pair(invWitness, msgWitness));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, invWitness));
     }
     LOCK(cs_vNodes);
     for (CNode* pnode : vNodes) {
@@ -1907,6 +2101,21 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // Timeframe expired, start a new cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::RecordSendCall(unsigned int nBuffers)
+{
+    LOCK(cs_totalBytesSent);
+    sendPathStats.nSendCalls++;
+    sendPathStats.nSendBuffers += nBuffers;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1921,6 +2130,100 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+CSendPathStats CNode::GetSendPathStats()
+{
+    LOCK(cs_totalBytesSent);
+    return sendPathStats;
+}
+
+void CNode::RecordSendLatency(SendClass sendClass, int64_t nMicros)
+{
+    LOCK(cs_totalBytesSent);
+    sendLatencyStats[sendClass].Add(nMicros);
+}
+
+CSendLatencyStats CNode::GetSendLatencyStats(SendClass sendClass)
+{
+    LOCK(cs_totalBytesSent);
+    return sendLatencyStats[sendClass];
+}
+
+mapMsgCmdTotals CNode::GetTotalSendPerMsgCmd()
+{
+    LOCK(cs_totalBytesSent);
+    return mapTotalSendPerMsgCmd;
+}
+
+mapMsgCmdTotals CNode::GetTotalRecvPerMsgCmd()
+{
+    LOCK(cs_totalBytesRecv);
+    return mapTotalRecvPerMsgCmd;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    // Relaying every new block once in full should fit in the target
+    uint64_t recommendedMinimum = (nMaxOutboundTimeframe / Params().TargetSpacing()) * MAX_BLOCK_SIZE_CURRENT;
+    nMaxOutboundLimit = limit;
+
+    if (limit > 0 && limit < recommendedMinimum)
+        LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServingLimit) {
+        // Keep enough of the target to relay each new block of the cycle once
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().TargetSpacing() * MAX_BLOCK_SIZE_CURRENT;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2052,7 +2355,9 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                                   addrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001),
+                                                                                                   filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
 {
     nServices = 0;
     nServicesExpected = 0;
@@ -2082,13 +2387,25 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
+    fSupportsCmpctBlocks = false;
+    fPreferCmpctBlocks = false;
+    minFeeFilter = 0;
+    nFeeFilteredInvs = 0;
+    lastSentFeeFilter = 0;
+    nextSendTimeFeeFilter = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
 
+    for (const std::string& msg : getAllNetMessageTypes()) {
+        mapSendPerMsgCmd[msg];
+        mapRecvPerMsgCmd[msg];
+    }
+    mapSendPerMsgCmd[NET_MESSAGE_COMMAND_OTHER];
+    mapRecvPerMsgCmd[NET_MESSAGE_COMMAND_OTHER];
+
     {
         LOCK(cs_nLastNodeId);
         id = nLastNodeId++;
@@ -2164,6 +2481,12 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
 }
 
 void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
+{
+    const char* pchCommand = ssSend.size() >= CMessageHeader::HEADER_SIZE ? &ssSend[MESSAGE_START_SIZE] : "";
+    EndMessage(GetDefaultSendClass(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))));
+}
+
+void CNode::EndMessage(SendClass sendClass) UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
@@ -2181,28 +2504,114 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    QueueMessage(FinalizeSerializedNetMsg(ssSend), false, sendClass);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg)
+{
+    const char* pchCommand = &(*msg)[MESSAGE_START_SIZE];
+    PushSerializedMessage(msg, GetDefaultSendClass(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))));
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg, SendClass sendClass)
+{
+    LOCK(cs_vSend);
+    std::string strCommand(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(strCommand.c_str()), msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    QueueMessage(msg, true, sendClass);
+}
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+void CNode::QueueMessage(const CSerializedNetMsg& msg, bool fShared, SendClass sendClass)
+{
+    // Priority messages go behind the ones of their class already queued, but ahead of
+    // every bulk message. A message partly written cannot be overtaken.
+    std::deque<CQueuedNetMsg>::iterator it = vSendMsg.end();
+    if (sendClass == SEND_CLASS_PRIORITY) {
+        it = vSendMsg.begin();
+        if (it != vSendMsg.end() && nSendOffset > 0)
+            it++;
+        while (it != vSendMsg.end() && it->sendClass == SEND_CLASS_PRIORITY)
+            it++;
+    }
+    vSendMsg.insert(it, CQueuedNetMsg(msg, GetTimeMicros(), sendClass));
+    nSendSize += msg->size();
+    RecordMessageQueued(msg, fShared);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+void CNode::RecordMessageQueued(const CSerializedNetMsg& msg, bool fShared)
+{
+    const char* pchCommand = &(*msg)[MESSAGE_START_SIZE];
+    mapMsgCmdTotals::iterator i = mapSendPerMsgCmd.find(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE)));
+    if (i == mapSendPerMsgCmd.end())
+        i = mapSendPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapSendPerMsgCmd.end());
+
+    LOCK(cs_totalBytesSent);
+    i->second.Add(msg->size());
+    mapTotalSendPerMsgCmd[i->first].Add(msg->size());
+    if (fShared)
+        sendPathStats.nSharedBytes += msg->size();
+    else
+        sendPathStats.nSerializedBytes += msg->size();
+}
+
+SendClass GetDefaultSendClass(const std::string& strCommand)
+{
+    // Masternode payment votes and SwiftTX lock votes lose their worth if they arrive late,
+    // and a compact block pushed to a high-bandwidth peer is a new block announcement
+    if (strCommand == NetMsgType::MNW || strCommand == NetMsgType::TXLVOTE || strCommand == NetMsgType::CMPCTBLOCK)
+        return SEND_CLASS_PRIORITY;
+    return SEND_CLASS_BULK;
+}
+
+const char* GetSendClassName(SendClass sendClass)
+{
+    switch (sendClass) {
+    case SEND_CLASS_PRIORITY:
+        return "priority";
+    case SEND_CLASS_BULK:
+        return "bulk";
+    default:
+        return "unknown";
+    }
+}
+
+void CSendLatencyStats::Add(int64_t nMicros)
+{
+    int nBucket = 0;
+    for (int64_t nMillis = std::max(nMicros, (int64_t)0) / 1000; nMillis > 0 && nBucket < SEND_LATENCY_BUCKETS - 1; nMillis >>= 1)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += std::max(nMicros, (int64_t)0);
+}
+
+CSerializedNetMsg FinalizeSerializedNetMsg(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    // Take the buffer rather than copying it
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
 }
 
 //
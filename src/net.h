@@ -8,11 +8,11 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "amount.h"
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -20,7 +20,9 @@
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
+#include "version.h"
 
+#include <algorithm>
 #include <deque>
 #include <stdint.h>
 
@@ -29,6 +31,7 @@
 #endif
 
 #include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/thread/thread.hpp>
 
@@ -45,6 +48,10 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of most recent addresses remembered per peer as known to it, so they are not relayed back */
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
+/** Number of most recent inventory items remembered per peer as known to it, so they are not announced twice */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 10000;
 /** Maximum length of incoming protocol messages (no message over 4 MB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
 /** -listen default */
@@ -57,6 +64,16 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Interval at which the message handler runs SendMessages for every node, for pings, trickled invs and addr relay (in milliseconds) */
+static const int64_t MESSAGE_HANDLER_SEND_INTERVAL = 100;
+/** -maxuploadtarget default in MiB per timeframe (0 = unlimited) */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** Timeframe over which -maxuploadtarget is enforced (in seconds) */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Blocks older than this (in seconds) count as historical and stop being served once the upload target is reached */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Traffic of message types we do not know is accounted under this name */
+static const char* const NET_MESSAGE_COMMAND_OTHER = "*other*";
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -80,6 +97,9 @@ void SocketSendData(CNode* pnode);
 
 typedef int NodeId;
 
+/** Queue node id for ThreadMessageHandler, e.g. because a complete message arrived for it */
+void WakeMessageHandler(NodeId id);
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
@@ -119,6 +139,29 @@ bool IsReachable(const CNetAddr& addr);
 CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 
+/**
+ * A complete wire message, header included. It is never modified once queued, so a
+ * message serialized once can be queued to any number of peers without copying it.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
+/** Set the size and checksum in the header at the front of ss and take its buffer as a message */
+CSerializedNetMsg FinalizeSerializedNetMsg(CDataStream& ss);
+
+/**
+ * Serialize a message once, to be queued to several peers with CNode::PushSerializedMessage().
+ * Only for payloads that serialize the same for every protocol version we speak (blocks,
+ * transactions); nFlags selects e.g. SERIALIZE_TRANSACTION_NO_WITNESS.
+ */
+template <typename T1>
+CSerializedNetMsg CreateSerializedNetMsg(int nFlags, const char* pszCommand, const T1& a1)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | nFlags);
+    ss << CMessageHeader(pszCommand, 0) << a1;
+    return FinalizeSerializedNetMsg(ss);
+}
+
+
 extern bool fDiscover;
 extern bool fListen;
 extern uint64_t nLocalServices;
@@ -129,7 +172,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsg> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -148,6 +191,22 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Bytes and number of messages of one message type */
+struct CMsgCmdTotals {
+    uint64_t nBytes;
+    uint64_t nCount;
+
+    CMsgCmdTotals() : nBytes(0), nCount(0) {}
+
+    void Add(uint64_t nMsgBytes)
+    {
+        nBytes += nMsgBytes;
+        nCount++;
+    }
+};
+
+typedef std::map<std::string, CMsgCmdTotals> mapMsgCmdTotals;
+
 class CNodeStats
 {
 public:
@@ -168,6 +227,11 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    CAmount minFeeFilter;
+    uint64_t nFeeFilteredInvs;
+    uint64_t nKnownFilterBytes;
+    mapMsgCmdTotals mapSendPerMsgCmd;
+    mapMsgCmdTotals mapRecvPerMsgCmd;
 };
 
 
@@ -273,6 +337,56 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+/** Outbound message classes. Messages of the priority class are written ahead of everything queued in the bulk class. */
+enum SendClass {
+    SEND_CLASS_PRIORITY, //! Relay between masternodes that is latency sensitive: new blocks, payment votes, SwiftTX lock votes
+    SEND_CLASS_BULK,     //! Everything else, getdata responses included
+    SEND_CLASS_COUNT
+};
+
+/** Class a message is queued in unless the sender picks one */
+SendClass GetDefaultSendClass(const std::string& strCommand);
+const char* GetSendClassName(SendClass sendClass);
+
+/** Buckets of the send latency histogram: below 1ms, then [2^(n-1), 2^n) ms, the last one open ended */
+static const int SEND_LATENCY_BUCKETS = 16;
+
+/** How long the messages of one class waited between being queued and their last byte being written */
+struct CSendLatencyStats {
+    uint64_t vBuckets[SEND_LATENCY_BUCKETS];
+    uint64_t nCount;
+    uint64_t nTotalMicros;
+
+    CSendLatencyStats() : nCount(0), nTotalMicros(0)
+    {
+        std::fill(vBuckets, vBuckets + SEND_LATENCY_BUCKETS, 0);
+    }
+
+    void Add(int64_t nMicros);
+};
+
+/** A message waiting in a peer's send queue */
+struct CQueuedNetMsg {
+    CSerializedNetMsg msg;
+    int64_t nTimeQueued;
+    SendClass sendClass;
+
+    CQueuedNetMsg(const CSerializedNetMsg& msgIn, int64_t nTimeQueuedIn, SendClass sendClassIn) : msg(msgIn), nTimeQueued(nTimeQueuedIn), sendClass(sendClassIn) {}
+};
+
+/** Where the bytes queued for sending come from, and how they went out */
+struct CSendPathStats {
+    //! Bytes serialized for a single peer (PushMessage)
+    uint64_t nSerializedBytes;
+    //! Bytes queued by reference to a message serialized once (PushSerializedMessage)
+    uint64_t nSharedBytes;
+    //! Send system calls made, and the messages they were handed; more messages than calls means vectored writes
+    uint64_t nSendCalls;
+    uint64_t nSendBuffers;
+
+    CSendPathStats() : nSerializedBytes(0), nSharedBytes(0), nSendCalls(0), nSendBuffers(0) {}
+};
+
 
 /** Information about a peer */
 class CNode
@@ -286,13 +400,18 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    //! Priority class messages first, then bulk ones; a partly sent message stays in front whatever its class
+    std::deque<CQueuedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
+    //! Messages queued to the peer by type, header included. Updated under cs_totalBytesSent.
+    mapMsgCmdTotals mapSendPerMsgCmd;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
+    //! Complete messages received by type, header included. Updated under cs_totalBytesRecv.
+    mapMsgCmdTotals mapRecvPerMsgCmd;
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -320,6 +439,10 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    //! The peer told us (sendcmpct) it understands our compact block version
+    bool fSupportsCmpctBlocks;
+    //! The peer asked us to push new blocks as cmpctblock instead of announcing them with an inv
+    bool fPreferCmpctBlocks;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -349,17 +472,26 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
+    // Fee rate (per 1000 bytes) below which the peer asked (feefilter) not to be told about transactions
+    CCriticalSection cs_feeFilter;
+    CAmount minFeeFilter;
+    // Transaction announcements withheld from the peer because of its feefilter
+    uint64_t nFeeFilteredInvs;
+    // Our own feefilter as last sent to the peer, and when to consider sending it again (usec)
+    CAmount lastSentFeeFilter;
+    int64_t nextSendTimeFeeFilter;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -379,10 +511,24 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CSendPathStats sendPathStats;
+    static CSendLatencyStats sendLatencyStats[SEND_CLASS_COUNT];
+    static mapMsgCmdTotals mapTotalSendPerMsgCmd;
+    static mapMsgCmdTotals mapTotalRecvPerMsgCmd;
+
+    // Upload target, all guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundTimeframe;
 
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSerializedNetMsg& msg, bool fShared, SendClass sendClass);
+    void RecordMessageQueued(const CSerializedNetMsg& msg, bool fShared);
+
 public:
     NodeId GetId() const
     {
@@ -429,7 +575,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -437,7 +583,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -451,7 +597,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.GetKey());
         }
     }
 
@@ -459,10 +605,13 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && setInventoryKnown.count(inv))
+            if ((inv.type == MSG_TX || inv.type == MSG_WITNESS_TX) && filterInventoryKnown.contains(inv.GetKey()))
                 return;
             vInventoryToSend.push_back(inv);
         }
+        // Transactions are trickled anyway; announce everything else (blocks, votes) without waiting for the next send sweep
+        if (inv.type != MSG_TX && inv.type != MSG_WITNESS_TX)
+            WakeMessageHandler(id);
     }
 
     void AskFor(const CInv& inv);
@@ -475,6 +624,11 @@ public:
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
+    void EndMessage(SendClass sendClass) UNLOCK_FUNCTION(cs_vSend);
+
+    /** Queue a message made by CreateSerializedNetMsg(), sharing rather than copying it */
+    void PushSerializedMessage(const CSerializedNetMsg& msg);
+    void PushSerializedMessage(const CSerializedNetMsg& msg, SendClass sendClass);
 
     void PushVersion();
 
@@ -503,6 +657,23 @@ public:
         }
     }
 
+    /** Send a message containing a1 in the given class rather than the one its command defaults to */
+    template<typename T1>
+    void PushMessageWithClass(SendClass sendClass, const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend << a1;
+            EndMessage(sendClass);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     /** Send a message containing a1, serialized with flag flag. */
     template<typename T1>
     void PushMessageWithFlag(int flag, const char* pszCommand, const T1& a1)
@@ -734,9 +905,30 @@ public:
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
+    static void RecordSendCall(unsigned int nBuffers);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static CSendPathStats GetSendPathStats();
+    static void RecordSendLatency(SendClass sendClass, int64_t nMicros);
+    static CSendLatencyStats GetSendLatencyStats(SendClass sendClass);
+    static mapMsgCmdTotals GetTotalSendPerMsgCmd();
+    static mapMsgCmdTotals GetTotalRecvPerMsgCmd();
+
+    //! Set the upload target in bytes per timeframe, 0 disables it
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! Whether the upload target was reached. With fHistoricalBlockServingLimit, whether
+    //! historical blocks should no longer be served, keeping room to relay new blocks.
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+
+    //! Bytes left in the current cycle, 0 if the target is reached or disabled
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! Seconds left in the current cycle, 0 if the target is disabled
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CExplicitNetCleanup
@@ -747,7 +939,6 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
@@ -15,6 +15,9 @@
 
 #include <list>
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 static const int SERIALIZE_TRANSACTION_NO_WITNESS = 0x40000000;
 static const unsigned int WITNESS_SCALE_FACTOR = 4;
 
@@ -403,6 +406,7 @@ public:
 
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
+    CTransaction(CMutableTransaction &&tx);
 
     CTransaction& operator=(const CTransaction& tx);
 
@@ -507,6 +511,15 @@ struct CMutableTransaction
 
 };
 
+/**
+ * A transaction shared between the mempool, blocks and relay without copying it.
+ * The pointee must never change, as its hash is cached.
+ */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return boost::make_shared<const CTransaction>(); }
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return boost::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 /** Compute the cost of a transaction, as defined by BIP 141 */
 int64_t GetTransactionCost(const CTransaction &tx);
 
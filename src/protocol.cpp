@@ -129,6 +129,7 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::GETBLOCKTXN,
     NetMsgType::BLOCKTXN
 };
+const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
 
 static const char* ppszTypeName[] =
     {
@@ -148,7 +149,8 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "cmpct block"};
 
 CMessageHeader::CMessageHeader()
 {
@@ -273,3 +275,18 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+std::vector<unsigned char> CInv::GetKey() const
+{
+    std::vector<unsigned char> vKey(hash.begin(), hash.end());
+    vKey.push_back(type & 0xff);
+    vKey.push_back((type >> 8) & 0xff);
+    vKey.push_back((type >> 16) & 0xff);
+    vKey.push_back((type >> 24) & 0xff);
+    return vKey;
+}
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
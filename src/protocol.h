@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -259,6 +260,9 @@ extern const char *GETBLOCKTXN;
 extern const char *BLOCKTXN;
 };
 
+/* Get a vector of all valid message types (see above) */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 
 /** Message header.
  * (4) message start.
@@ -388,6 +392,8 @@ public:
     bool IsMasterNodeType() const;
     const char* GetCommand() const;
     std::string ToString() const;
+    //! Type and hash as one key, e.g. for CRollingBloomFilter
+    std::vector<unsigned char> GetKey() const;
 
     // TODO: make private (improves encapsulation)
 public:
@@ -415,11 +421,13 @@ enum GetDataMsg {
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
     MSG_DSTX,
+    //! Only in getdata: answer with a cmpctblock for recent blocks, a full block otherwise
+    MSG_CMPCT_BLOCK,
     MSG_WITNESS_BLOCK = MSG_BLOCK | MSG_WITNESS_FLAG,
     MSG_WITNESS_TX = MSG_TX | MSG_WITNESS_FLAG,
     MSG_FILTERED_WITNESS_BLOCK = MSG_FILTERED_BLOCK | MSG_WITNESS_FLAG,
 };
 
-const int MSG_TYPE_MAX = MSG_DSTX;
+const int MSG_TYPE_MAX = MSG_CMPCT_BLOCK;
 
 #endif // BITCOIN_PROTOCOL_H
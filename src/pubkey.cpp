@@ -6,26 +6,199 @@
 
 #include "eccryptoverify.h"
 
-#ifdef USE_SECP256K1
 #include <secp256k1.h>
-#else
+#ifndef USE_SECP256K1
 #include "ecwrapper.h"
 #endif
 
+#include <string.h>
+
+//! anonymous namespace
+namespace
+{
+    /**
+     * Signature verification always uses libsecp256k1, whose precomputed tables
+     * are built once here rather than an OpenSSL key being set up per signature.
+     * Starting is idempotent, so this coexists with the signing setup in key.cpp.
+     */
+    class CSecp256k1VerifyInit
+    {
+    public:
+        CSecp256k1VerifyInit()
+        {
+            secp256k1_start(SECP256K1_START_VERIFY);
+        }
+        ~CSecp256k1VerifyInit()
+        {
+            secp256k1_stop();
+        }
+    };
+    static CSecp256k1VerifyInit instance_of_csecp256k1verify;
+
+    /**
+     * Parse a DER-ish encoded ECDSA signature into its 32-byte R and S values,
+     * accepting the BER and lax DER encodings OpenSSL's d2i_ECDSA_SIG did: long
+     * form and padded lengths, excess leading zeroes in the integers, garbage
+     * after the signature, and an inconsistent sequence length. Signatures that
+     * are not subject to DERSIG (block signatures, alerts) are still verified
+     * against these rules, so they must keep accepting what OpenSSL accepted.
+     * Returns false if the encoding cannot be parsed, R or S is negative or a
+     * value is longer than 32 bytes; values at or above the group order are
+     * left to the verifier.
+     */
+    bool ecdsa_signature_parse_der_lax(const unsigned char* input, size_t inputlen, unsigned char* rs64)
+    {
+        size_t rpos, rlen, spos, slen;
+        size_t pos = 0;
+        size_t lenbyte;
+
+        memset(rs64, 0, 64);
+
+        // Sequence tag byte
+        if (pos == inputlen || input[pos] != 0x30)
+            return false;
+        pos++;
+
+        // Sequence length bytes
+        if (pos == inputlen)
+            return false;
+        lenbyte = input[pos++];
+        if (lenbyte & 0x80) {
+            lenbyte -= 0x80;
+            if (lenbyte > inputlen - pos)
+                return false;
+            pos += lenbyte;
+        }
+
+        // Integer tag byte for R
+        if (pos == inputlen || input[pos] != 0x02)
+            return false;
+        pos++;
+
+        // Integer length for R
+        if (pos == inputlen)
+            return false;
+        lenbyte = input[pos++];
+        if (lenbyte & 0x80) {
+            lenbyte -= 0x80;
+            if (lenbyte > inputlen - pos)
+                return false;
+            while (lenbyte > 0 && input[pos] == 0) {
+                pos++;
+                lenbyte--;
+            }
+            if (lenbyte >= 4)
+                return false;
+            rlen = 0;
+            while (lenbyte > 0) {
+                rlen = (rlen << 8) + input[pos];
+                pos++;
+                lenbyte--;
+            }
+        } else {
+            rlen = lenbyte;
+        }
+        if (rlen > inputlen - pos)
+            return false;
+        // A negative R is an invalid signature to OpenSSL
+        if (rlen > 0 && (input[pos] & 0x80))
+            return false;
+        rpos = pos;
+        pos += rlen;
+
+        // Integer tag byte for S
+        if (pos == inputlen || input[pos] != 0x02)
+            return false;
+        pos++;
+
+        // Integer length for S
+        if (pos == inputlen)
+            return false;
+        lenbyte = input[pos++];
+        if (lenbyte & 0x80) {
+            lenbyte -= 0x80;
+            if (lenbyte > inputlen - pos)
+                return false;
+            while (lenbyte > 0 && input[pos] == 0) {
+                pos++;
+                lenbyte--;
+            }
+            if (lenbyte >= 4)
+                return false;
+            slen = 0;
+            while (lenbyte > 0) {
+                slen = (slen << 8) + input[pos];
+                pos++;
+                lenbyte--;
+            }
+        } else {
+            slen = lenbyte;
+        }
+        if (slen > inputlen - pos)
+            return false;
+        // A negative S is an invalid signature to OpenSSL
+        if (slen > 0 && (input[pos] & 0x80))
+            return false;
+        spos = pos;
+
+        // Ignore leading zeroes in R and S
+        while (rlen > 0 && input[rpos] == 0) {
+            rlen--;
+            rpos++;
+        }
+        while (slen > 0 && input[spos] == 0) {
+            slen--;
+            spos++;
+        }
+        if (rlen > 32 || slen > 32)
+            return false;
+        memcpy(rs64 + 32 - rlen, input + rpos, rlen);
+        memcpy(rs64 + 64 - slen, input + spos, slen);
+        return true;
+    }
+
+    /** Serialize 32-byte R and S values as a strict DER signature. */
+    void ecdsa_signature_serialize_der(const unsigned char* rs64, std::vector<unsigned char>& vchSig)
+    {
+        unsigned char r[33] = {0}, s[33] = {0};
+        memcpy(r + 1, rs64, 32);
+        memcpy(s + 1, rs64 + 32, 32);
+        unsigned char *rp = r, *sp = s;
+        size_t lenR = 33, lenS = 33;
+        while (lenR > 1 && rp[0] == 0 && rp[1] < 0x80) {
+            lenR--;
+            rp++;
+        }
+        while (lenS > 1 && sp[0] == 0 && sp[1] < 0x80) {
+            lenS--;
+            sp++;
+        }
+        vchSig.clear();
+        vchSig.reserve(6 + lenR + lenS);
+        vchSig.push_back(0x30);
+        vchSig.push_back(4 + lenR + lenS);
+        vchSig.push_back(0x02);
+        vchSig.push_back(lenR);
+        vchSig.insert(vchSig.end(), rp, rp + lenR);
+        vchSig.push_back(0x02);
+        vchSig.push_back(lenS);
+        vchSig.insert(vchSig.end(), sp, sp + lenS);
+    }
+
+} // anon namespace
+
 bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
 {
     if (!IsValid())
         return false;
-#ifdef USE_SECP256K1
-    if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSig[0], vchSig.size(), begin(), size()) != 1)
+    // libsecp256k1 only parses strict DER, so re-encode lax signatures first
+    unsigned char rs64[64];
+    if (!ecdsa_signature_parse_der_lax(vchSig.data(), vchSig.size(), rs64))
         return false;
-#else
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    std::vector<unsigned char> vchSigDER;
+    ecdsa_signature_serialize_der(rs64, vchSigDER);
+    if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSigDER[0], vchSigDER.size(), begin(), size()) != 1)
         return false;
-    if (!key.Verify(hash, vchSig))
-        return false;
-#endif
     return true;
 }
 
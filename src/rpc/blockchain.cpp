@@ -95,7 +95,8 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(make_pair("version", block.nVersion));
     result.push_back(make_pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    for (const CTransaction& tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if (txDetails) {
             UniValue objTx(UniValue::VOBJ);
             TxToJSON(tx, uint256(0), objTx, true, RPCSerializationFlags());
@@ -712,7 +713,8 @@ UniValue getfeeinfo(const UniValue& params, bool fHelp)
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             if (tx.IsCoinBase() || tx.IsCoinStake())
                 continue;
 
@@ -757,6 +759,17 @@ UniValue mempoolInfoToJSON()
     ret.push_back(make_pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     //ret.push_back(make_pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
 
+    CMempoolScriptStats stats;
+    GetMempoolScriptStats(stats);
+    UniValue scriptchecks(UniValue::VOBJ);
+    scriptchecks.push_back(make_pair("serialtxs", (int64_t)stats.nSerialTx));
+    scriptchecks.push_back(make_pair("serialinputs", (int64_t)stats.nSerialInputs));
+    scriptchecks.push_back(make_pair("serialtime", stats.nSerialMicros * 0.000001));
+    scriptchecks.push_back(make_pair("paralleltxs", (int64_t)stats.nParallelTx));
+    scriptchecks.push_back(make_pair("parallelinputs", (int64_t)stats.nParallelInputs));
+    scriptchecks.push_back(make_pair("paralleltime", stats.nParallelMicros * 0.000001));
+    ret.push_back(make_pair("scriptchecks", scriptchecks));
+
     return ret;
 }
 
@@ -770,6 +783,14 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"scriptchecks\": {           (json object) Script verification of accepted and rejected txs\n"
+            "    \"serialtxs\": xxxxx         (numeric) Txs verified on the message handler thread\n"
+            "    \"serialinputs\": xxxxx      (numeric) Inputs of those txs\n"
+            "    \"serialtime\": x.xxx        (numeric) Seconds spent verifying them\n"
+            "    \"paralleltxs\": xxxxx       (numeric) Txs verified on the script verification threads\n"
+            "    \"parallelinputs\": xxxxx    (numeric) Inputs of those txs\n"
+            "    \"paralleltime\": x.xxx      (numeric) Seconds spent verifying them\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getmempoolinfo", "") + HelpExampleRpc("getmempoolinfo", ""));
@@ -522,7 +522,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    for (CTransaction& tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
@@ -570,7 +571,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(make_pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(make_pair("transactions", transactions));
     result.push_back(make_pair("coinbaseaux", aux));
-    result.push_back(make_pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
+    result.push_back(make_pair("coinbasevalue", (int64_t)pblock->vtx[0]->GetValueOut()));
     result.push_back(make_pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(make_pair("target", hashTarget.GetHex()));
     result.push_back(make_pair("mintime", (int64_t)pindexPrev->GetMedianTimePast() + 1));
@@ -589,7 +590,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         CTxDestination address1;
         ExtractDestination(pblock->payee, address1);
         result.push_back(make_pair("payee", EncodeDestination(address1).c_str()));
-        result.push_back(make_pair("payee_amount", (int64_t)pblock->vtx[0].vout[1].nValue));
+        result.push_back(make_pair("payee_amount", (int64_t)pblock->vtx[0]->vout[1].nValue));
     } else {
         result.push_back(make_pair("payee", ""));
         result.push_back(make_pair("payee_amount", ""));
@@ -73,6 +73,21 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+/** Traffic per message type, leaving out the types not seen */
+static UniValue MsgCmdTotalsToJSON(const mapMsgCmdTotals& mapTotals)
+{
+    UniValue obj(UniValue::VOBJ);
+    for (const mapMsgCmdTotals::value_type& i : mapTotals) {
+        if (i.second.nCount == 0)
+            continue;
+        UniValue totals(UniValue::VOBJ);
+        totals.push_back(make_pair("bytes", i.second.nBytes));
+        totals.push_back(make_pair("count", i.second.nCount));
+        obj.push_back(make_pair(i.first, totals));
+    }
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -104,7 +119,18 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"minfeefilter\": n,         (numeric) The minimum fee rate in SCC/kB for transactions the peer wants announced\n"
+            "    \"feefiltered\": n,          (numeric) The transaction announcements withheld from the peer because of its fee filter\n"
+            "    \"knownfilterbytes\": n,     (numeric) Memory in bytes used to remember the inventory and addresses the peer knows\n"
+            "    \"sent_per_msg\": {\n"
+            "       \"cmd\": {                 (json object) Traffic of one message type, unknown types are listed as \"*other*\"\n"
+            "         \"bytes\": n,            (numeric) Bytes including message headers\n"
+            "         \"count\": n             (numeric) Number of messages\n"
+            "       }, ...\n"
+            "    },\n"
+            "    \"recv_per_msg\": {...}      (json object) The same for received messages\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -154,6 +180,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(make_pair("inflight", heights));
         }
         obj.push_back(make_pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(make_pair("minfeefilter", ValueFromAmount(stats.minFeeFilter)));
+        obj.push_back(make_pair("feefiltered", stats.nFeeFilteredInvs));
+        obj.push_back(make_pair("knownfilterbytes", stats.nKnownFilterBytes));
+        obj.push_back(make_pair("sent_per_msg", MsgCmdTotalsToJSON(stats.mapSendPerMsgCmd)));
+        obj.push_back(make_pair("recv_per_msg", MsgCmdTotalsToJSON(stats.mapRecvPerMsgCmd)));
 
         ret.push_back(obj);
     }
@@ -341,7 +372,36 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"sendpath\": {\n"
+            "    \"serializedbytes\": n,  (numeric) Bytes serialized into the send queue of a single peer\n"
+            "    \"sharedbytes\": n,      (numeric) Bytes queued by reference to a message serialized once for several peers\n"
+            "    \"sendcalls\": n,        (numeric) Send system calls made\n"
+            "    \"sendbuffers\": n       (numeric) Messages handed to those calls, more than sendcalls when writes were vectored\n"
+            "  },\n"
+            "  \"blockcache\": {\n"
+            "    \"hits\": n,              (numeric) Block requests answered with an already serialized block\n"
+            "    \"misses\": n,            (numeric) Block requests that read the block from disk\n"
+            "    \"hitbytes\": n           (numeric) Bytes of blocks sent from the cache\n"
+            "  },\n"
+            "  \"sendlatency\": {         (json object) Time from queueing a message to writing its last byte, per send class\n"
+            "    \"priority\": {         (json object) New blocks, masternode payment votes and SwiftTX lock votes\n"
+            "      \"count\": n,          (numeric) Messages sent\n"
+            "      \"avg_us\": n,         (numeric) Average latency in microseconds\n"
+            "      \"histogram\": [n,...] (array) Messages per latency bucket: below 1ms, then from 2^(i-1) to 2^i ms, the last one open ended\n"
+            "    },\n"
+            "    \"bulk\": {...}         (json object) The same for all other messages\n"
+            "  },\n"
+            "  \"uploadtarget\": {\n"
+            "    \"timeframe\": n,                 (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                    (numeric) Target in bytes, 0 if there is none\n"
+            "    \"target_reached\": true|false,   (boolean) True if the target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if historical blocks are served to peers that are not whitelisted\n"
+            "    \"bytes_left_in_cycle\": n,       (numeric) Bytes left in the current time cycle\n"
+            "    \"time_left_in_cycle\": n         (numeric) Seconds left in the current time cycle\n"
+            "  },\n"
+            "  \"sent_per_msg\": {...},   (json object) Traffic of all peers per message type, as in getpeerinfo\n"
+            "  \"recv_per_msg\": {...}    (json object) The same for received messages\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -350,6 +410,126 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(make_pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(make_pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(make_pair("timemillis", GetTimeMillis()));
+
+    CSendPathStats sendPathStats = CNode::GetSendPathStats();
+    UniValue sendPathObj(UniValue::VOBJ);
+    sendPathObj.push_back(make_pair("serializedbytes", sendPathStats.nSerializedBytes));
+    sendPathObj.push_back(make_pair("sharedbytes", sendPathStats.nSharedBytes));
+    sendPathObj.push_back(make_pair("sendcalls", sendPathStats.nSendCalls));
+    sendPathObj.push_back(make_pair("sendbuffers", sendPathStats.nSendBuffers));
+    obj.push_back(make_pair("sendpath", sendPathObj));
+
+    CServedBlockCacheStats blockCacheStats;
+    GetServedBlockCacheStats(blockCacheStats);
+    UniValue blockCacheObj(UniValue::VOBJ);
+    blockCacheObj.push_back(make_pair("hits", blockCacheStats.nHits));
+    blockCacheObj.push_back(make_pair("misses", blockCacheStats.nMisses));
+    blockCacheObj.push_back(make_pair("hitbytes", blockCacheStats.nHitBytes));
+    obj.push_back(make_pair("blockcache", blockCacheObj));
+
+    UniValue sendLatencyObj(UniValue::VOBJ);
+    for (int i = 0; i < SEND_CLASS_COUNT; i++) {
+        CSendLatencyStats latencyStats = CNode::GetSendLatencyStats((SendClass)i);
+        UniValue classObj(UniValue::VOBJ);
+        classObj.push_back(make_pair("count", latencyStats.nCount));
+        classObj.push_back(make_pair("avg_us", latencyStats.nCount ? latencyStats.nTotalMicros / latencyStats.nCount : 0));
+        UniValue histogram(UniValue::VARR);
+        for (int n = 0; n < SEND_LATENCY_BUCKETS; n++)
+            histogram.push_back(latencyStats.vBuckets[n]);
+        classObj.push_back(make_pair("histogram", histogram));
+        sendLatencyObj.push_back(make_pair(GetSendClassName((SendClass)i), classObj));
+    }
+    obj.push_back(make_pair("sendlatency", sendLatencyObj));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(make_pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(make_pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(make_pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(make_pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(make_pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(make_pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(make_pair("uploadtarget", outboundLimit));
+
+    obj.push_back(make_pair("sent_per_msg", MsgCmdTotalsToJSON(CNode::GetTotalSendPerMsgCmd())));
+    obj.push_back(make_pair("recv_per_msg", MsgCmdTotalsToJSON(CNode::GetTotalRecvPerMsgCmd())));
+    return obj;
+}
+
+UniValue getmessagestats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "\nReturns statistics of the P2P message handlers, one entry per command.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"command\": \"xxxx\",   (string) The P2P command\n"
+            "    \"count\": n,          (numeric) Number of messages handled\n"
+            "    \"failed\": n,         (numeric) Number of messages the handler rejected\n"
+            "    \"totaltime\": n,      (numeric) Total time spent in the handler, in microseconds\n"
+            "    \"maxtime\": n,        (numeric) Longest time spent on a single message, in microseconds\n"
+            "    \"queuetime\": n,      (numeric) Total time messages waited between being received and handled, in microseconds\n"
+            "    \"maxqueuetime\": n    (numeric) Longest time a single message waited to be handled, in microseconds\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagestats", "") + HelpExampleRpc("getmessagestats", ""));
+
+    std::vector<CMessageHandlerStats> vStats;
+    GetMessageHandlerStats(vStats);
+
+    UniValue ret(UniValue::VARR);
+    for (const CMessageHandlerStats& stats : vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(make_pair("command", stats.strCommand));
+        obj.push_back(make_pair("count", (int64_t)stats.nCount));
+        obj.push_back(make_pair("failed", (int64_t)stats.nFailed));
+        obj.push_back(make_pair("totaltime", stats.nTimeMicros));
+        obj.push_back(make_pair("maxtime", stats.nMaxTimeMicros));
+        obj.push_back(make_pair("queuetime", stats.nQueueMicros));
+        obj.push_back(make_pair("maxqueuetime", stats.nMaxQueueMicros));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+UniValue getcompactblockstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getcompactblockstats\n"
+            "\nReturns statistics of compact block relay.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sent\": n,                 (numeric) Number of cmpctblock messages sent\n"
+            "  \"received\": n,             (numeric) Number of cmpctblock messages received for new blocks\n"
+            "  \"reconstructed\": n,        (numeric) Blocks rebuilt from the mempool alone\n"
+            "  \"roundtrips\": n,           (numeric) Blocks rebuilt after requesting missing transactions\n"
+            "  \"fallbacks\": n,            (numeric) Blocks that had to be requested in full\n"
+            "  \"compactbytes\": n,         (numeric) Bytes received to rebuild blocks\n"
+            "  \"blockbytes\": n,           (numeric) Serialized size of the rebuilt blocks\n"
+            "  \"bytesperblock\": n,        (numeric) Average bytes received per rebuilt block\n"
+            "  \"avgreconstructtime\": n    (numeric) Average time to rebuild a block, in microseconds\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getcompactblockstats", "") + HelpExampleRpc("getcompactblockstats", ""));
+
+    CCompactBlockStats stats;
+    GetCompactBlockStats(stats);
+    uint64_t nRebuilt = stats.nReconstructed + stats.nRoundTrips;
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(make_pair("sent", (int64_t)stats.nSent));
+    obj.push_back(make_pair("received", (int64_t)stats.nReceived));
+    obj.push_back(make_pair("reconstructed", (int64_t)stats.nReconstructed));
+    obj.push_back(make_pair("roundtrips", (int64_t)stats.nRoundTrips));
+    obj.push_back(make_pair("fallbacks", (int64_t)stats.nFallbacks));
+    obj.push_back(make_pair("compactbytes", (int64_t)stats.nCompactBytes));
+    obj.push_back(make_pair("blockbytes", (int64_t)stats.nBlockBytes));
+    obj.push_back(make_pair("bytesperblock", nRebuilt ? (int64_t)(stats.nCompactBytes / nRebuilt) : 0));
+    obj.push_back(make_pair("avgreconstructtime", nRebuilt ? stats.nReconstructMicros / (int64_t)nRebuilt : 0));
     return obj;
 }
 
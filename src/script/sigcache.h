@@ -10,6 +10,12 @@
 
 #include <vector>
 
+/** Default for -maxsigcachesize in MiB, shared by the signature and script execution caches at 32 bytes an entry */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Largest -maxsigcachesize accepted, in MiB. Larger values are taken for an entry count from
+ *  versions that did not size the cache in MiB, and the default is used instead. */
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 1024;
+
 class CPubKey;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
@@ -18,9 +24,12 @@ private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn) : TransactionSignatureChecker(txToIn, nInIn, amount), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, PrecomputedTransactionData& txdataIn) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Size the signature cache from -maxsigcachesize. Call before the script check threads start. */
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
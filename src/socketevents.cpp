@@ -0,0 +1,219 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+
+CSelectSocketEvents::CSelectSocketEvents()
+{
+    Reset();
+}
+
+void CSelectSocketEvents::Reset()
+{
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    vSockets.clear();
+    hSocketMax = 0;
+    fWaited = false;
+}
+
+void CSelectSocketEvents::Add(SOCKET hSocket, unsigned int nEvents, int64_t nOwner)
+{
+    // The first Add() after a Wait() starts a new iteration
+    if (fWaited)
+        Reset();
+    if (!IsSelectableSocket(hSocket))
+        return;
+
+    if (nEvents & SOCKET_EVENT_RECV)
+        FD_SET(hSocket, &fdsetRecv);
+    if (nEvents & SOCKET_EVENT_SEND)
+        FD_SET(hSocket, &fdsetSend);
+    if (nEvents & SOCKET_EVENT_ERR)
+        FD_SET(hSocket, &fdsetError);
+    vSockets.push_back(hSocket);
+    hSocketMax = std::max(hSocketMax, hSocket);
+}
+
+bool CSelectSocketEvents::Wait(int64_t nTimeoutMs)
+{
+    struct timeval timeout = MillisToTimeval(nTimeoutMs);
+    int nSelect = select(vSockets.empty() ? 0 : hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    fWaited = true;
+    if (nSelect == SOCKET_ERROR) {
+        // Report every socket as readable so the caller's recv() finds the broken one
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        for (SOCKET hSocket : vSockets)
+            FD_SET(hSocket, &fdsetRecv);
+        return false;
+    }
+    return true;
+}
+
+unsigned int CSelectSocketEvents::GetEvents(SOCKET hSocket) const
+{
+    if (!fWaited || !IsSelectableSocket(hSocket))
+        return SOCKET_EVENT_NONE;
+
+    unsigned int nEvents = SOCKET_EVENT_NONE;
+    if (FD_ISSET(hSocket, &fdsetRecv))
+        nEvents |= SOCKET_EVENT_RECV;
+    if (FD_ISSET(hSocket, &fdsetSend))
+        nEvents |= SOCKET_EVENT_SEND;
+    if (FD_ISSET(hSocket, &fdsetError))
+        nEvents |= SOCKET_EVENT_ERR;
+    return nEvents;
+}
+
+#ifdef USE_EPOLL
+CEpollSocketEvents::CEpollSocketEvents() : hEpoll(epoll_create1(EPOLL_CLOEXEC)), nIteration(1), fWaited(false)
+{
+}
+
+CEpollSocketEvents::~CEpollSocketEvents()
+{
+    if (hEpoll != -1)
+        close(hEpoll);
+}
+
+void CEpollSocketEvents::Add(SOCKET hSocket, unsigned int nEvents, int64_t nOwner)
+{
+    // The first Add() after a Wait() starts a new iteration
+    if (fWaited) {
+        vDeclaredSockets.clear();
+        ++nIteration;
+        fWaited = false;
+    }
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    if ((size_t)hSocket >= vSlots.size())
+        vSlots.resize(hSocket + 1);
+    CSocketSlot& slot = vSlots[hSocket];
+    if (slot.nDeclared != nIteration)
+        vDeclaredSockets.push_back(hSocket);
+    slot.nOwner = nOwner;
+    slot.nEvents = nEvents;
+    slot.nDeclared = nIteration;
+}
+
+bool CEpollSocketEvents::Submit(SOCKET hSocket, unsigned int nEvents, bool fRegistered)
+{
+    // EPOLLERR and EPOLLHUP are always reported, whether asked for or not
+    struct epoll_event event;
+    event.events = ((nEvents & SOCKET_EVENT_RECV) ? (uint32_t)EPOLLIN : 0) | ((nEvents & SOCKET_EVENT_SEND) ? (uint32_t)EPOLLOUT : 0);
+    event.data.u64 = 0;
+    event.data.fd = hSocket;
+
+    int nOp = fRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(hEpoll, nOp, hSocket, &event) == 0)
+        return true;
+
+    // Our view of the kernel's interest set can be stale if a socket was closed and its number reused
+    if (nOp == EPOLL_CTL_MOD && errno == ENOENT)
+        nOp = EPOLL_CTL_ADD;
+    else if (nOp == EPOLL_CTL_ADD && errno == EEXIST)
+        nOp = EPOLL_CTL_MOD;
+    else
+        return false;
+    return epoll_ctl(hEpoll, nOp, hSocket, &event) == 0;
+}
+
+bool CEpollSocketEvents::Wait(int64_t nTimeoutMs)
+{
+    // Forget sockets that were not declared this iteration or now belong to another connection.
+    // Closed sockets were already dropped by the kernel, so errors are expected here.
+    for (SOCKET hSocket : vRegisteredSockets) {
+        CSocketSlot& slot = vSlots[hSocket];
+        if (slot.nDeclared != nIteration || slot.nOwner != slot.nOwnerRegistered) {
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+            slot.fRegistered = false;
+        }
+    }
+
+    // Only resubmit interest that actually changed
+    vRegisteredSockets.clear();
+    for (SOCKET hSocket : vDeclaredSockets) {
+        CSocketSlot& slot = vSlots[hSocket];
+        if (!slot.fRegistered || slot.nEvents != slot.nEventsRegistered) {
+            if (!Submit(hSocket, slot.nEvents, slot.fRegistered)) {
+                LogPrint("net", "epoll_ctl failed for socket %d: %s\n", hSocket, NetworkErrorString(errno));
+                slot.fRegistered = false;
+                continue;
+            }
+            slot.fRegistered = true;
+            slot.nOwnerRegistered = slot.nOwner;
+            slot.nEventsRegistered = slot.nEvents;
+        }
+        vRegisteredSockets.push_back(hSocket);
+    }
+
+    for (SOCKET hSocket : vReadySockets)
+        vSlots[hSocket].nReady = SOCKET_EVENT_NONE;
+    vReadySockets.clear();
+    fWaited = true;
+
+    vEvents.resize(std::max<size_t>(vRegisteredSockets.size(), 1));
+    int nReady = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), nTimeoutMs);
+    if (nReady < 0)
+        return false;
+
+    for (int i = 0; i < nReady; i++) {
+        const struct epoll_event& event = vEvents[i];
+        SOCKET hSocket = event.data.fd;
+        unsigned int nEvents = SOCKET_EVENT_NONE;
+        if (event.events & EPOLLIN)
+            nEvents |= SOCKET_EVENT_RECV;
+        if (event.events & EPOLLOUT)
+            nEvents |= SOCKET_EVENT_SEND;
+        if (event.events & (EPOLLERR | EPOLLHUP))
+            nEvents |= SOCKET_EVENT_ERR;
+        vSlots[hSocket].nReady = nEvents;
+        vReadySockets.push_back(hSocket);
+    }
+    return true;
+}
+
+unsigned int CEpollSocketEvents::GetEvents(SOCKET hSocket) const
+{
+    if (!fWaited || hSocket == INVALID_SOCKET || (size_t)hSocket >= vSlots.size())
+        return SOCKET_EVENT_NONE;
+    return vSlots[hSocket].nReady;
+}
+#endif
+
+std::vector<std::string> GetSocketEventsModes()
+{
+    std::vector<std::string> vModes;
+#ifdef USE_EPOLL
+    vModes.push_back("epoll");
+#endif
+    vModes.push_back("select");
+    return vModes;
+}
+
+CSocketEvents* CreateSocketEvents(const std::string& strMode)
+{
+#ifdef USE_EPOLL
+    if (strMode == "epoll") {
+        CEpollSocketEvents* pEvents = new CEpollSocketEvents();
+        if (pEvents->IsValid())
+            return pEvents;
+        delete pEvents;
+        return NULL;
+    }
+#endif
+    if (strMode == "select")
+        return new CSelectSocketEvents();
+    return NULL;
+}
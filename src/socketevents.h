@@ -0,0 +1,141 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#if defined(HAVE_CONFIG_H)
+#include "config/stakecubecoin-config.h"
+#endif
+
+#include "compat.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#if defined(HAVE_SYS_EPOLL_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/** Default for -socketevents */
+#ifdef USE_EPOLL
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
+/** Events ThreadSocketHandler waits for on a socket */
+enum SocketEventFlags {
+    SOCKET_EVENT_NONE = 0,
+    SOCKET_EVENT_RECV = (1U << 0),
+    SOCKET_EVENT_SEND = (1U << 1),
+    SOCKET_EVENT_ERR = (1U << 2),
+};
+
+/**
+ * Readiness notification for the sockets serviced by ThreadSocketHandler.
+ *
+ * Every iteration the caller declares its interest in each socket with Add(),
+ * blocks in Wait() and then queries the outcome with GetEvents(). Sockets that
+ * were not declared in an iteration are forgotten. nOwner identifies the
+ * connection owning a socket, so that a socket number reused by a new
+ * connection is never mistaken for the old one.
+ */
+class CSocketEvents
+{
+public:
+    virtual ~CSocketEvents() {}
+
+    virtual const char* GetName() const = 0;
+    /** Whether this backend can service hSocket at all */
+    virtual bool IsSupported(SOCKET hSocket) const = 0;
+    virtual void Add(SOCKET hSocket, unsigned int nEvents, int64_t nOwner) = 0;
+    /** Wait until one of the declared events happens or nTimeoutMs passes. Returns false on error. */
+    virtual bool Wait(int64_t nTimeoutMs) = 0;
+    virtual unsigned int GetEvents(SOCKET hSocket) const = 0;
+};
+
+/** select() based backend, available everywhere but limited to sockets below FD_SETSIZE */
+class CSelectSocketEvents : public CSocketEvents
+{
+private:
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    std::vector<SOCKET> vSockets;
+    SOCKET hSocketMax;
+    bool fWaited;
+
+    void Reset();
+
+public:
+    CSelectSocketEvents();
+
+    const char* GetName() const { return "select"; }
+    bool IsSupported(SOCKET hSocket) const { return IsSelectableSocket(hSocket); }
+    void Add(SOCKET hSocket, unsigned int nEvents, int64_t nOwner);
+    bool Wait(int64_t nTimeoutMs);
+    unsigned int GetEvents(SOCKET hSocket) const;
+};
+
+#ifdef USE_EPOLL
+/**
+ * epoll based backend. The interest set stays registered in the kernel across
+ * iterations and only sockets whose interest changed are resubmitted, so an
+ * idle iteration costs a single epoll_wait() regardless of the peer count.
+ */
+class CEpollSocketEvents : public CSocketEvents
+{
+private:
+    //! What we know about one socket number, indexed by the socket itself
+    struct CSocketSlot {
+        //! Interest declared in the iteration numbered nDeclared
+        int64_t nOwner;
+        unsigned int nEvents;
+        uint64_t nDeclared;
+        //! Interest currently known to the kernel
+        bool fRegistered;
+        int64_t nOwnerRegistered;
+        unsigned int nEventsRegistered;
+        //! Events reported by the last Wait()
+        unsigned int nReady;
+
+        CSocketSlot() : nOwner(0), nEvents(0), nDeclared(0), fRegistered(false), nOwnerRegistered(0), nEventsRegistered(0), nReady(0) {}
+    };
+
+    int hEpoll;
+    std::vector<CSocketSlot> vSlots;
+    std::vector<SOCKET> vDeclaredSockets;
+    std::vector<SOCKET> vRegisteredSockets;
+    std::vector<SOCKET> vReadySockets;
+    //! Buffer handed to epoll_wait(), kept across iterations to avoid reallocation
+    std::vector<struct epoll_event> vEvents;
+    uint64_t nIteration;
+    bool fWaited;
+
+    bool Submit(SOCKET hSocket, unsigned int nEvents, bool fRegistered);
+
+public:
+    CEpollSocketEvents();
+    ~CEpollSocketEvents();
+
+    bool IsValid() const { return hEpoll != -1; }
+    const char* GetName() const { return "epoll"; }
+    bool IsSupported(SOCKET hSocket) const { return hSocket != INVALID_SOCKET; }
+    void Add(SOCKET hSocket, unsigned int nEvents, int64_t nOwner);
+    bool Wait(int64_t nTimeoutMs);
+    unsigned int GetEvents(SOCKET hSocket) const;
+};
+#endif
+
+/** Names accepted by -socketevents on this platform */
+std::vector<std::string> GetSocketEventsModes();
+
+/** Create the backend named strMode, or NULL if it is not available */
+CSocketEvents* CreateSocketEvents(const std::string& strMode);
+
+#endif // BITCOIN_SOCKETEVENTS_H
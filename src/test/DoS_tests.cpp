@@ -14,25 +14,17 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanpool.h"
 #include "util.h"
 
+#include <algorithm>
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -105,15 +97,6 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
-{
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
-}
-
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
     CKey key;
@@ -121,6 +104,10 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    COrphanTxPool pool;
+    std::vector<CTransaction> vOrphans;
+    int64_t nNow = GetTime();
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -133,13 +120,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(pool.AddTx(MakeTransactionRef(tx), i, nNow));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = vOrphans[GetRand(vOrphans.size())];
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -150,13 +138,18 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(pool.AddTx(MakeTransactionRef(tx), i, nNow));
+        BOOST_CHECK(!pool.AddTx(MakeTransactionRef(tx), i, nNow)); // already known
+
+        std::vector<uint256> vChildren;
+        pool.GetChildren(txPrev.GetHash(), vChildren);
+        BOOST_CHECK(std::find(vChildren.begin(), vChildren.end(), tx.GetHash()) != vChildren.end());
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = vOrphans[GetRand(vOrphans.size())];
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -174,25 +167,63 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!pool.AddTx(MakeTransactionRef(tx), i, nNow));
     }
+    BOOST_CHECK_EQUAL(pool.Size(), 100U);
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = pool.Size();
+        unsigned int nForPeer = pool.CountForPeer(i);
+        BOOST_CHECK(nForPeer > 0);
+        BOOST_CHECK_EQUAL(pool.EraseForPeer(i), nForPeer);
+        BOOST_CHECK_EQUAL(pool.Size(), sizeBefore - nForPeer);
+        BOOST_CHECK_EQUAL(pool.CountForPeer(i), 0U);
+    }
+
+    // Test LimitSize() by count:
+    pool.LimitSize(40, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(pool.Size() <= 40);
+    pool.LimitSize(10, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(pool.Size() <= 10);
+
+    // ... and by size:
+    size_t nMaxBytes = pool.TotalTxSize() / 2;
+    pool.LimitSize(std::numeric_limits<unsigned int>::max(), nMaxBytes);
+    BOOST_CHECK(pool.TotalTxSize() <= nMaxBytes);
+    pool.LimitSize(0, std::numeric_limits<size_t>::max());
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
+    BOOST_CHECK_EQUAL(pool.TotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanExpiry)
+{
+    COrphanTxPool pool;
+    int64_t nNow = GetTime();
+
+    for (int i = 0; i < 10; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+
+        // Half of the orphans arrive later and outlive the others
+        BOOST_CHECK(pool.AddTx(MakeTransactionRef(tx), i, i < 5 ? nNow : nNow + ORPHAN_TX_EXPIRE_TIME));
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(pool.Expire(nNow), 0U);
+    BOOST_CHECK_EQUAL(pool.Size(), 10U);
+    // Sweeps are rate limited
+    BOOST_CHECK_EQUAL(pool.Expire(nNow + ORPHAN_TX_EXPIRE_TIME), 0U);
+    BOOST_CHECK_EQUAL(pool.Expire(nNow + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL), 5U);
+    BOOST_CHECK_EQUAL(pool.Size(), 5U);
+    BOOST_CHECK_EQUAL(pool.Expire(nNow + 3 * ORPHAN_TX_EXPIRE_TIME), 5U);
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
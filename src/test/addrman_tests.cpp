@@ -0,0 +1,122 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "netbase.h"
+#include "streams.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+/** A routable IPv4 address, distinct for every n */
+static CAddress MakeAddress(uint32_t n)
+{
+    struct in_addr ip;
+    ip.s_addr = htonl(0x0B000000 + n * 7919);
+    CAddress addr(CService(CNetAddr(ip), 40000));
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+static CNetAddr MakeSource(uint32_t n)
+{
+    return CNetAddr(strprintf("%d.1.1.1", 20 + n % 100));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_simple)
+{
+    CAddrMan addrman;
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CAddress addr1 = MakeAddress(1);
+    BOOST_CHECK(addrman.Add(addr1, MakeSource(1)));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+
+    // Adding the same address again does not create a second entry
+    BOOST_CHECK(!addrman.Add(addr1, MakeSource(1)));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // Unroutable addresses are refused
+    BOOST_CHECK(!addrman.Add(CAddress(CService("192.168.1.1", 40000)), MakeSource(1)));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // An address moved to tried is still selected
+    addrman.Good(addr1);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == addr1);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    std::vector<CAddress> vAddr;
+    for (uint32_t n = 0; n < 1000; n++)
+        vAddr.push_back(MakeAddress(n));
+    for (uint32_t n = 0; n < vAddr.size(); n++)
+        addrman.Add(vAddr[n], MakeSource(n));
+    for (uint32_t n = 0; n < vAddr.size(); n += 10)
+        addrman.Good(vAddr[n]);
+    BOOST_CHECK(addrman.size() > 0);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CDataStream ssCopy(ss);
+
+    CAddrMan addrmanLoaded;
+    ss >> addrmanLoaded;
+    BOOST_CHECK_EQUAL(addrmanLoaded.size(), addrman.size());
+
+    // Loading keeps every entry in place, so saving again gives the same peers.dat
+    CDataStream ssLoaded(SER_DISK, CLIENT_VERSION);
+    ssLoaded << addrmanLoaded;
+    BOOST_CHECK(ssLoaded.str() == ssCopy.str());
+
+    std::vector<CAddress> vAddrLoaded = addrmanLoaded.GetAddr();
+    BOOST_CHECK(!vAddrLoaded.empty());
+    for (const CAddress& addr : vAddrLoaded)
+        BOOST_CHECK(std::find(vAddr.begin(), vAddr.end(), addr) != vAddr.end());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_timing)
+{
+    const uint32_t nAddresses = 100000;
+    std::vector<CAddress> vAddr;
+    for (uint32_t n = 0; n < nAddresses; n++)
+        vAddr.push_back(MakeAddress(n));
+
+    CAddrMan addrman;
+    int64_t nStart = GetTimeMicros();
+    for (uint32_t n = 0; n < nAddresses; n++)
+        addrman.Add(vAddr[n], MakeSource(n));
+    int64_t nAdd = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < 10000; n++)
+        BOOST_REQUIRE(addrman.Select().IsValid());
+    int64_t nSelect = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    int64_t nSave = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CAddrMan addrmanLoaded;
+    ss >> addrmanLoaded;
+    int64_t nLoad = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(addrmanLoaded.size(), addrman.size());
+
+    BOOST_TEST_MESSAGE(nAddresses << " addresses (" << addrman.size() << " kept): add " << nAdd / 1000 << "ms, 10000 selects " << nSelect / 1000 <<
+                       "ms, save " << nSave / 1000 << "ms, load " << nLoad / 1000 << "ms");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
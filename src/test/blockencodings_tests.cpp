@@ -0,0 +1,145 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase(int nTx)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.push_back(MakeTransactionRef(tx));
+    for (int i = 1; i < nTx; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        tx.vout[0].nValue = 42 + i;
+        block.vtx.push_back(MakeTransactionRef(tx));
+    }
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRead;
+    stream >> cmpctblockRead;
+    return cmpctblockRead;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(3));
+    pool.addUnchecked(block.vtx[1]->GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0, 0));
+    pool.addUnchecked(block.vtx[2]->GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0, 0));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(RoundTrip(CBlockHeaderAndShortTxIDs(block)));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 2U);
+
+    CBlock blockRebuilt;
+    BOOST_CHECK(partialBlock.FillBlock(blockRebuilt, std::vector<CTransactionRef>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRebuilt.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(blockRebuilt.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+
+    // A compact block of plain transactions is a fraction of the block
+    size_t nCompactSize = ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nBlockSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_TEST_MESSAGE("cmpctblock " << nCompactSize << " bytes for a block of " << nBlockSize << " bytes");
+    BOOST_CHECK(nCompactSize < nBlockSize);
+}
+
+BOOST_AUTO_TEST_CASE(MissingTransactionsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(4));
+    pool.addUnchecked(block.vtx[2]->GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0, 0));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(RoundTrip(CBlockHeaderAndShortTxIDs(block)));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+    // The getblocktxn request and its answer survive serialization
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes.push_back(1);
+    req.indexes.push_back(3);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest reqRead;
+    stream >> reqRead;
+    BOOST_CHECK_EQUAL(reqRead.blockhash.ToString(), req.blockhash.ToString());
+    BOOST_REQUIRE_EQUAL(reqRead.indexes.size(), 2U);
+    BOOST_CHECK_EQUAL(reqRead.indexes[0], 1);
+    BOOST_CHECK_EQUAL(reqRead.indexes[1], 3);
+
+    BlockTransactions resp(reqRead);
+    resp.txn[0] = block.vtx[1];
+    resp.txn[1] = block.vtx[3];
+    stream << resp;
+    BlockTransactions respRead;
+    stream >> respRead;
+    BOOST_REQUIRE_EQUAL(respRead.txn.size(), 2U);
+
+    // Too few transactions is the peer's fault
+    PartiallyDownloadedBlock partialBlockShort(&pool);
+    BOOST_CHECK(partialBlockShort.InitData(cmpctblock) == READ_STATUS_OK);
+    CBlock blockShort;
+    BOOST_CHECK(partialBlockShort.FillBlock(blockShort, std::vector<CTransactionRef>(1, block.vtx[1])) == READ_STATUS_INVALID);
+
+    // Transactions that do not match the merkle root mean we have to fetch the block
+    PartiallyDownloadedBlock partialBlockWrong(&pool);
+    BOOST_CHECK(partialBlockWrong.InitData(cmpctblock) == READ_STATUS_OK);
+    CBlock blockWrong;
+    BOOST_CHECK(partialBlockWrong.FillBlock(blockWrong, std::vector<CTransactionRef>(2, block.vtx[1])) == READ_STATUS_FAILED);
+
+    CBlock blockRebuilt;
+    BOOST_CHECK(partialBlock.FillBlock(blockRebuilt, respRead.txn) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRebuilt.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(blockRebuilt.vtx[3]->GetHash().ToString(), block.vtx[3]->GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(RoundTrip(CBlockHeaderAndShortTxIDs(block)));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock blockRebuilt;
+    BOOST_CHECK(partialBlock.FillBlock(blockRebuilt, std::vector<CTransactionRef>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRebuilt.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "utiltime.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockprefetch_tests)
+
+/** Put an unspent output of a new transaction into db and return that transaction */
+static CTransaction AddCoins(CCoinsViewDB& db)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 10 * COIN;
+    CCoinsViewCache cache(&db);
+    *cache.ModifyCoins(tx.GetHash()) = CCoins(tx, 1);
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    return tx;
+}
+
+/** A proof-of-stake shaped block whose coinstake spends txFrom, with a transaction spending the coinstake */
+static CBlock MakeBlock(const CTransaction& txFrom)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 10 * COIN;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(CTransaction(coinstake).GetHash(), 1);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 9 * COIN;
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    block.vtx.push_back(MakeTransactionRef(coinstake));
+    block.vtx.push_back(MakeTransactionRef(spend));
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(block.IsProofOfStake());
+    return block;
+}
+
+static bool WaitForReads(CBlockPrefetcher& prefetcher, uint64_t nBlocks)
+{
+    for (int i = 0; i < 1000 && prefetcher.GetStats().nBlocksRead < nBlocks; i++)
+        MilliSleep(10);
+    return prefetcher.GetStats().nBlocksRead == nBlocks;
+}
+
+BOOST_AUTO_TEST_CASE(blockprefetch_read_ahead)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CBlockPrefetcher prefetcher(&db, 4);
+    boost::thread thread(boost::bind(&CBlockPrefetcher::Thread, &prefetcher));
+
+    std::vector<CBlock> vBlock;
+    std::vector<std::pair<uint256, CDiskBlockPos> > vBlocks;
+    for (int i = 0; i < 2; i++) {
+        vBlock.push_back(MakeBlock(AddCoins(db)));
+        CDiskBlockPos pos(1000 + i, 0);
+        BOOST_REQUIRE(WriteBlockToDisk(vBlock[i], pos));
+        vBlocks.push_back(std::make_pair(vBlock[i].GetHash(), pos));
+    }
+    prefetcher.Request(vBlocks);
+    BOOST_REQUIRE(WaitForReads(prefetcher, 2));
+    // Only the coin the coinstake spends is in the database
+    BOOST_CHECK_EQUAL(prefetcher.GetStats().nCoinsRead, 2U);
+
+    // Taking a block hands over its coins
+    CBlock block;
+    CCoinsViewCache cache(&db);
+    BOOST_CHECK(prefetcher.Take(vBlock[0].GetHash(), block, cache));
+    BOOST_CHECK(block.GetHash() == vBlock[0].GetHash());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.HaveCoins(vBlock[0].vtx[1]->vin[0].prevout.hash));
+    BOOST_CHECK_EQUAL(prefetcher.GetStats().nCoinsAdded, 1U);
+
+    // Once taken, it is gone
+    BOOST_CHECK(!prefetcher.Take(vBlock[0].GetHash(), block, cache));
+    BOOST_CHECK(!prefetcher.Take(GetRandHash(), block, cache));
+    BOOST_CHECK_EQUAL(prefetcher.GetStats().nMisses, 2U);
+
+    // After the database has been written to, the coins read before are not used
+    AddCoins(db);
+    CCoinsViewCache cache2(&db);
+    BOOST_CHECK(prefetcher.Take(vBlock[1].GetHash(), block, cache2));
+    BOOST_CHECK(block.GetHash() == vBlock[1].GetHash());
+    BOOST_CHECK_EQUAL(cache2.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(prefetcher.GetStats().nCoinsStale, 1U);
+
+    // Blocks no longer requested are dropped
+    prefetcher.Request(vBlocks);
+    BOOST_REQUIRE(WaitForReads(prefetcher, 4));
+    prefetcher.Request(std::vector<std::pair<uint256, CDiskBlockPos> >(1, vBlocks[1]));
+    BOOST_CHECK(!prefetcher.Take(vBlock[0].GetHash(), block, cache));
+    BOOST_CHECK(prefetcher.Take(vBlock[1].GetHash(), block, cache));
+
+    prefetcher.Stop();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
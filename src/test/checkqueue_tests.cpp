@@ -0,0 +1,142 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+/** Counts how often it ran and on which thread, takes nMicros and returns fOk */
+struct CCountingCheck {
+    std::atomic<unsigned int>* pnRun;
+    boost::thread::id* pThreadId;
+    bool fOk;
+    int nMicros;
+
+    CCountingCheck() : pnRun(NULL), pThreadId(NULL), fOk(true), nMicros(0) {}
+    CCountingCheck(std::atomic<unsigned int>* pnRunIn, boost::thread::id* pThreadIdIn, bool fOkIn, int nMicrosIn = 0) : pnRun(pnRunIn), pThreadId(pThreadIdIn), fOk(fOkIn), nMicros(nMicrosIn) {}
+
+    bool operator()()
+    {
+        if (nMicros)
+            boost::this_thread::sleep(boost::posix_time::microseconds(nMicros));
+        (*pnRun)++;
+        if (pThreadId)
+            *pThreadId = boost::this_thread::get_id();
+        return fOk;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(pnRun, check.pnRun);
+        std::swap(pThreadId, check.pThreadId);
+        std::swap(fOk, check.fOk);
+        std::swap(nMicros, check.nMicros);
+    }
+};
+
+static void QueueThread(CCheckQueue<CCountingCheck>* pqueue)
+{
+    pqueue->Thread();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4, 4);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&QueueThread, &queue));
+
+    // Blocks of different sizes, added in uneven pieces, each check run exactly once
+    for (unsigned int nChecks : {0, 1, 4, 5, 100, 5000}) {
+        std::atomic<unsigned int> nRun(0);
+        std::vector<boost::thread::id> vThreadId(nChecks);
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            for (unsigned int i = 0; i < nChecks; i += 1 + i % 7) {
+                std::vector<CCountingCheck> vChecks;
+                for (unsigned int j = i; j < std::min(nChecks, i + 1 + i % 7); j++)
+                    vChecks.push_back(CCountingCheck(&nRun, &vThreadId[j], true));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK_EQUAL(control.GetCount(), nChecks);
+            BOOST_CHECK_EQUAL(control.IsQueued(), nChecks > queue.GetInlineMax());
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nRun, nChecks);
+        BOOST_CHECK(queue.IsIdle());
+
+        // Few checks are run by the thread waiting for them
+        if (nChecks <= queue.GetInlineMax())
+            for (const boost::thread::id& id : vThreadId)
+                BOOST_CHECK(id == boost::this_thread::get_id());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4, 4);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&QueueThread, &queue));
+
+    std::atomic<unsigned int> nRun(0);
+    for (unsigned int nChecks : {3, 1000}) {
+        for (unsigned int nFail = 0; nFail < nChecks; nFail += nChecks / 3) {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            std::vector<CCountingCheck> vChecks;
+            for (unsigned int i = 0; i < nChecks; i++)
+                vChecks.push_back(CCountingCheck(&nRun, NULL, i != nFail));
+            control.Add(vChecks);
+            BOOST_CHECK(!control.Wait());
+        }
+    }
+
+    // A failure does not carry over to the next block
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100, CCountingCheck(&nRun, NULL, true));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_CHECK(queue.IsIdle());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_stealing)
+{
+    // Three workers share one deque, the master has the other: the workers run
+    // out of their half long before the master is through its own and steal from it
+    CCheckQueue<CCountingCheck> queue(8, 2, 0);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&QueueThread, &queue));
+
+    for (int n = 0; n < 3; n++) {
+        std::atomic<unsigned int> nRun(0);
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(200, CCountingCheck(&nRun, NULL, true, 200));
+        control.Add(vChecks);
+        BOOST_CHECK(control.IsQueued());
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRun, 200U);
+    }
+    BOOST_CHECK(queue.GetStolen() > 0);
+    BOOST_CHECK(queue.IsIdle());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,8 +9,10 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <vector>
 
@@ -132,6 +134,38 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // OpenSSL is the reference, whichever transforms SHA256AutoDetect() picked
+    unsigned char in[64 * 32];
+    unsigned char out1[32 * 32], out2[32 * 32];
+    for (int i = 0; i <= 32; i++) {
+        for (int j = 0; j < 64 * i; j++)
+            in[j] = insecure_rand();
+        for (int j = 0; j < i; j++) {
+            unsigned char hash[32];
+            EVP_Digest(in + 64 * j, 64, hash, NULL, EVP_sha256(), NULL);
+            EVP_Digest(hash, 32, out1 + 32 * j, NULL, EVP_sha256(), NULL);
+        }
+        SHA256D64(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+        // The output may overwrite the input, as merkle tree levels do
+        SHA256D64(in, in, i);
+        BOOST_CHECK(memcmp(out1, in, 32 * i) == 0);
+    }
+
+    std::vector<unsigned char> vIn(64 * 100000);
+    std::vector<unsigned char> vOut(32 * 100000);
+    int64_t nStart = GetTimeMicros();
+    for (size_t i = 0; i < 100000; i++)
+        CHash256().Write(&vIn[64 * i], 64).Finalize(&vOut[32 * i]);
+    int64_t nSerial = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    SHA256D64(&vOut[0], &vIn[0], 100000);
+    int64_t nBatch = GetTimeMicros() - nStart;
+    BOOST_TEST_MESSAGE("100000 double SHA-256 of 64 bytes: " << nSerial / 1000 << "ms one at a time, " << nBatch / 1000 << "ms with SHA256D64");
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -0,0 +1,67 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+static std::vector<uint256> RandomKeys(size_t nKeys)
+{
+    std::vector<uint256> vKeys;
+    for (size_t n = 0; n < nKeys; n++)
+        vKeys.push_back(GetRandHash());
+    return vKeys;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    CCuckooCache cache;
+    BOOST_CHECK(!cache.Contains(GetRandHash()));
+    cache.Insert(GetRandHash());
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+
+    BOOST_CHECK_EQUAL(cache.Setup(1 << 20), (1U << 20) / 32);
+    BOOST_CHECK(!cache.Contains(GetRandHash()));
+    // Zero marks a free slot and is never stored
+    cache.Insert(uint256(0));
+    BOOST_CHECK(!cache.Contains(uint256(0)));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    CCuckooCache cache;
+    uint32_t nEntries = cache.Setup(1 << 20);
+
+    // Filled to 90% every key finds a slot
+    std::vector<uint256> vKeys = RandomKeys(nEntries * 9 / 10);
+    for (const uint256& key : vKeys)
+        cache.Insert(key);
+    size_t nFound = 0;
+    for (const uint256& key : vKeys)
+        nFound += cache.Contains(key);
+    BOOST_CHECK_EQUAL(nFound, vKeys.size());
+
+    std::vector<uint256> vOther = RandomKeys(10000);
+    for (const uint256& key : vOther)
+        BOOST_CHECK(!cache.Contains(key));
+
+    // Inserting twice the capacity keeps memory fixed; recent keys mostly survive
+    std::vector<uint256> vMore = RandomKeys(nEntries * 2);
+    for (const uint256& key : vMore)
+        cache.Insert(key);
+    BOOST_CHECK_EQUAL(cache.Size(), nEntries);
+    nFound = 0;
+    for (size_t n = vMore.size() - nEntries / 2; n < vMore.size(); n++)
+        nFound += cache.Contains(vMore[n]);
+    BOOST_TEST_MESSAGE(nFound << " of the last " << nEntries / 2 << " keys inserted into a full cache of " << nEntries << " entries found");
+    BOOST_CHECK(nFound > nEntries / 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
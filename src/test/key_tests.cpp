@@ -5,10 +5,13 @@
 #include "key.h"
 
 #include "base58.h"
+#include "ecwrapper.h"
+#include "random.h"
 #include "script/script.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <string>
 #include <vector>
@@ -187,4 +190,213 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("20a12c9145860e14ee6dba6c15e66e4cfa5984aa6bc9c094ea7af0f35cc842d4a229b5f1276da285b2f92bdb2c8c5e41f1bdb5519384b1b5bca23caeeeedf5b68e"));
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_openssl)
+{
+    // CPubKey::Verify uses libsecp256k1; it has to agree with the OpenSSL verifier it replaced
+    const int nSigs = 1000;
+    std::vector<CPubKey> vPubKey;
+    std::vector<uint256> vHash;
+    std::vector<std::vector<unsigned char> > vSig;
+    for (int i = 0; i < nSigs; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig;
+        BOOST_REQUIRE(key.Sign(hash, vchSig));
+        // Some signatures are for another message, some have a byte of s changed
+        if (i % 4 == 1)
+            hash = GetRandHash();
+        if (i % 8 == 2)
+            vchSig.back() ^= 0x01;
+        vPubKey.push_back(key.GetPubKey());
+        vHash.push_back(hash);
+        vSig.push_back(vchSig);
+    }
+
+    std::vector<bool> vResult;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nSigs; i++)
+        vResult.push_back(vPubKey[i].Verify(vHash[i], vSig[i]));
+    int64_t nSecp256k1 = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nSigs; i++) {
+        CECKey key;
+        BOOST_REQUIRE(key.SetPubKey(vPubKey[i].begin(), vPubKey[i].size()));
+        BOOST_CHECK_EQUAL(key.Verify(vHash[i], vSig[i]), vResult[i]);
+        BOOST_CHECK_EQUAL(vResult[i], i % 4 != 1 && i % 8 != 2);
+    }
+    int64_t nOpenSSL = GetTimeMicros() - nStart;
+
+    // Truncated signatures are rejected
+    BOOST_CHECK(!vPubKey[0].Verify(vHash[0], std::vector<unsigned char>()));
+    BOOST_CHECK(!vPubKey[0].Verify(vHash[0], std::vector<unsigned char>(vSig[0].begin(), vSig[0].begin() + 7)));
+
+    BOOST_TEST_MESSAGE(nSigs << " signatures verified: libsecp256k1 " << nSecp256k1 / 1000 << "ms, OpenSSL " << nOpenSSL / 1000 << "ms");
+}
+
+static std::vector<unsigned char> NegateS(const std::vector<unsigned char>& vchSig)
+{
+    // Replace s by n - s; the signature stays valid with the opposite s parity
+    static const unsigned char order[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+        0xBA, 0xAE, 0xDC, 0xE6, 0xAF, 0x48, 0xA0, 0x3B, 0xBF, 0xD2, 0x5E, 0x8C, 0xD0, 0x36, 0x41, 0x41};
+    unsigned int lenR = vchSig[3];
+    unsigned int lenS = vchSig[5 + lenR];
+    unsigned char s[32] = {0};
+    unsigned int nSkip = lenS > 32 ? lenS - 32 : 0;
+    memcpy(s + 32 - (lenS - nSkip), &vchSig[6 + lenR + nSkip], lenS - nSkip);
+    unsigned char ns[33] = {0};
+    int borrow = 0;
+    for (int i = 31; i >= 0; i--) {
+        int d = order[i] - s[i] - borrow;
+        borrow = d < 0;
+        ns[i + 1] = d & 0xFF;
+    }
+    unsigned char* p = ns;
+    unsigned int lenNS = 33;
+    while (lenNS > 1 && p[0] == 0 && p[1] < 0x80) {
+        p++;
+        lenNS--;
+    }
+    std::vector<unsigned char> vchRet(vchSig.begin(), vchSig.begin() + 4 + lenR);
+    vchRet[1] = 4 + lenR + lenNS;
+    vchRet.push_back(0x02);
+    vchRet.push_back(lenNS);
+    vchRet.insert(vchRet.end(), p, p + lenNS);
+    return vchRet;
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_lax_der)
+{
+    // Block signatures and alerts are not subject to DERSIG, so CPubKey::Verify
+    // keeps accepting the non-strict encodings OpenSSL used to parse
+    for (int i = 0; i < 16; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig;
+        BOOST_REQUIRE(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+
+        unsigned int lenR = vchSig[3];
+        std::vector<unsigned char> vchR(vchSig.begin() + 4, vchSig.begin() + 4 + lenR);
+        std::vector<unsigned char> vchS(vchSig.begin() + 6 + lenR, vchSig.end());
+
+        // Long form sequence length
+        std::vector<unsigned char> vchLong;
+        vchLong.push_back(0x30);
+        vchLong.push_back(0x81);
+        vchLong.insert(vchLong.end(), vchSig.begin() + 1, vchSig.end());
+        BOOST_CHECK(pubkey.Verify(hash, vchLong));
+
+        // Excess leading zeroes in R and a padded long form length for S
+        std::vector<unsigned char> vchPadded;
+        vchPadded.push_back(0x30);
+        vchPadded.push_back(vchSig[1] + 4);
+        vchPadded.push_back(0x02);
+        vchPadded.push_back(lenR + 2);
+        vchPadded.push_back(0x00);
+        vchPadded.push_back(0x00);
+        vchPadded.insert(vchPadded.end(), vchR.begin(), vchR.end());
+        vchPadded.push_back(0x02);
+        vchPadded.push_back(0x82);
+        vchPadded.push_back(0x00);
+        vchPadded.push_back(vchS.size());
+        vchPadded.insert(vchPadded.end(), vchS.begin(), vchS.end());
+        BOOST_CHECK(pubkey.Verify(hash, vchPadded));
+
+        // Trailing garbage and a wrong sequence length
+        std::vector<unsigned char> vchTrailing(vchSig);
+        vchTrailing[1] = 0x00;
+        vchTrailing.push_back(0x01);
+        vchTrailing.push_back(0x02);
+        BOOST_CHECK(pubkey.Verify(hash, vchTrailing));
+
+        // High S
+        std::vector<unsigned char> vchHighS = NegateS(vchSig);
+        BOOST_CHECK(vchHighS != vchSig);
+        BOOST_CHECK(pubkey.Verify(hash, vchHighS));
+
+        // A re-encoded signature is still checked against the message and key
+        BOOST_CHECK(!pubkey.Verify(GetRandHash(), vchPadded));
+        vchPadded.back() ^= 0x01;
+        BOOST_CHECK(!pubkey.Verify(hash, vchPadded));
+    }
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_REQUIRE(key.Sign(hash, vchSig));
+
+    // Encodings that cannot be parsed at all are still rejected
+    std::vector<unsigned char> vchBad(vchSig);
+    vchBad[0] = 0x31;
+    BOOST_CHECK(!pubkey.Verify(hash, vchBad));
+    vchBad = vchSig;
+    vchBad[2] = 0x03;
+    BOOST_CHECK(!pubkey.Verify(hash, vchBad));
+    vchBad = vchSig;
+    vchBad[3] = 0x7f;
+    BOOST_CHECK(!pubkey.Verify(hash, vchBad));
+    vchBad = vchSig;
+    vchBad[3] = 0x85;
+    BOOST_CHECK(!pubkey.Verify(hash, vchBad));
+
+    // R or S longer than 32 significant bytes
+    std::vector<unsigned char> vchLongR;
+    vchLongR.push_back(0x30);
+    vchLongR.push_back(vchSig[1] + 1);
+    vchLongR.push_back(0x02);
+    vchLongR.push_back(vchSig[3] + 1);
+    vchLongR.push_back(0x01);
+    vchLongR.insert(vchLongR.end(), vchSig.begin() + 4, vchSig.end());
+    BOOST_CHECK(!pubkey.Verify(hash, vchLongR));
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_negative_der)
+{
+    // An R or S with its sign bit set is a negative INTEGER, which OpenSSL
+    // never verified; dropping the 0x00 padding of a valid value creates one
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CECKey eckey;
+    BOOST_REQUIRE(eckey.SetPubKey(pubkey.begin(), pubkey.size()));
+
+    bool fNegativeR = false, fNegativeS = false;
+    for (int i = 0; i < 256 && !(fNegativeR && fNegativeS); i++) {
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig;
+        BOOST_REQUIRE(key.Sign(hash, vchSig));
+
+        if (vchSig[3] == 33 && vchSig[4] == 0x00) {
+            std::vector<unsigned char> vchNegative(vchSig);
+            vchNegative.erase(vchNegative.begin() + 4);
+            vchNegative[1]--;
+            vchNegative[3]--;
+            BOOST_CHECK(!pubkey.Verify(hash, vchNegative));
+            BOOST_CHECK(!eckey.Verify(hash, vchNegative));
+            fNegativeR = true;
+        }
+
+        std::vector<unsigned char> vchHighS = NegateS(vchSig);
+        BOOST_REQUIRE(pubkey.Verify(hash, vchHighS));
+        unsigned int nPosS = 4 + vchHighS[3];
+        if (vchHighS[nPosS + 1] == 33 && vchHighS[nPosS + 2] == 0x00) {
+            std::vector<unsigned char> vchNegative(vchHighS);
+            vchNegative.erase(vchNegative.begin() + nPosS + 2);
+            vchNegative[1]--;
+            vchNegative[nPosS + 1]--;
+            BOOST_CHECK(!pubkey.Verify(hash, vchNegative));
+            BOOST_CHECK(!eckey.Verify(hash, vchNegative));
+            fNegativeS = true;
+        }
+    }
+    BOOST_CHECK(fNegativeR && fNegativeS);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,9 @@
 
 #include "primitives/transaction.h"
 #include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "timedata.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -54,4 +57,105 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     }
 }
 
+static CBlockHeader NextHeader(const CBlockIndex* pindexPrev)
+{
+    CBlockHeader header;
+    header.nVersion = CBlockHeader::CURRENT_VERSION;
+    header.hashPrevBlock = pindexPrev->GetBlockHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = pindexPrev->nTime + 60;
+    header.nBits = GetNextWorkRequired(pindexPrev, &header);
+    header.nNonce = 0;
+    return header;
+}
+
+static bool ProcessHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, int& nDoS, CBlockIndex** ppindex = NULL)
+{
+    state = CValidationState();
+    nDoS = 0;
+    bool ret = ProcessNewBlockHeaders(headers, state, ppindex);
+    state.IsInvalid(nDoS);
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(process_new_block_headers)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlockIndex* pindexBestHeaderBefore = pindexBestHeader;
+    std::vector<CBlockHeader> headers;
+    CValidationState state;
+    int nDoS;
+
+    BOOST_CHECK(ProcessHeaders(headers, state, nDoS));
+
+    // Unknown parent
+    CBlockHeader header = NextHeader(pindexTip);
+    header.hashPrevBlock = GetRandHash();
+    headers.assign(1, header);
+    BOOST_CHECK(!ProcessHeaders(headers, state, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-prevblk");
+
+    // Difficulty not following the retarget rules
+    header = NextHeader(pindexTip);
+    header.nBits -= 1;
+    headers.assign(1, header);
+    BOOST_CHECK(!ProcessHeaders(headers, state, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-diffbits");
+
+    // Timestamp too far in the future
+    header = NextHeader(pindexTip);
+    header.nTime = GetAdjustedTime() + 3 * 60 * 60;
+    headers.assign(1, header);
+    BOOST_CHECK(!ProcessHeaders(headers, state, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "time-too-new");
+
+    // Headers that add no work to the active chain are not indexed
+    header = NextHeader(pindexTip);
+    header.nBits = 0;
+    headers.assign(1, header);
+    BOOST_CHECK(!ProcessHeaders(headers, state, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "too-little-chainwork");
+
+    // None of the rejected headers made it into the index
+    BOOST_CHECK_EQUAL(pindexBestHeader, pindexBestHeaderBefore);
+
+    // A valid sequence is indexed without block data
+    CBlockHeader header1 = NextHeader(pindexTip);
+    uint256 hash1 = header1.GetHash();
+    CBlockIndex indexHeader1(header1);
+    indexHeader1.phashBlock = &hash1;
+    indexHeader1.pprev = pindexTip;
+    indexHeader1.nHeight = pindexTip->nHeight + 1;
+    CBlockHeader header2 = NextHeader(&indexHeader1);
+    headers.clear();
+    headers.push_back(header1);
+    headers.push_back(header2);
+    CBlockIndex* pindexLast = NULL;
+    BOOST_CHECK(ProcessHeaders(headers, state, nDoS, &pindexLast));
+    BOOST_REQUIRE(pindexLast != NULL);
+    BOOST_CHECK(pindexLast->GetBlockHash() == header2.GetHash());
+    BOOST_CHECK(pindexLast->pprev->GetBlockHash() == hash1);
+    BOOST_CHECK_EQUAL(pindexLast->nHeight, pindexTip->nHeight + 2);
+    BOOST_CHECK(!(pindexLast->nStatus & BLOCK_HAVE_DATA));
+    BOOST_CHECK(!pindexLast->IsProofOfStake());
+    BOOST_CHECK_EQUAL(pindexBestHeader, pindexLast);
+    BOOST_CHECK_EQUAL(chainActive.Tip(), pindexTip);
+
+    // Known headers are accepted again
+    CBlockIndex* pindexAgain = NULL;
+    BOOST_CHECK(ProcessHeaders(headers, state, nDoS, &pindexAgain));
+    BOOST_CHECK_EQUAL(pindexAgain, pindexLast);
+
+    // Every header has to build on the previous one
+    headers[1] = NextHeader(pindexTip);
+    BOOST_CHECK(!ProcessHeaders(headers, state, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 20);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-headers-sequence");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -51,7 +51,7 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     // Nothing in pool, remove should do nothing:
     testPool.remove(txParent, removed, true);
@@ -99,4 +99,24 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolFeeRateLookupTest)
+{
+    // feefilter compares announcements against the fee rate the pool recorded
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    CFeeRate feeRate;
+    BOOST_CHECK(!testPool.lookupFeeRate(tx.GetHash(), feeRate));
+
+    CTxMemPoolEntry entry(tx, 5000LL, 0, 0.0, 1);
+    testPool.addUnchecked(tx.GetHash(), entry);
+    BOOST_CHECK(testPool.lookupFeeRate(tx.GetHash(), feeRate));
+    BOOST_CHECK(feeRate == CFeeRate(5000LL, entry.GetTxSize()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
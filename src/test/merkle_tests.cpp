@@ -0,0 +1,117 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(merkle_tests)
+
+/** The merkle root one pair at a time; mutated if any pair hashed was of equal nodes */
+static uint256 NaiveMerkleRoot(std::vector<uint256> vHashes, bool& fMutated)
+{
+    fMutated = false;
+    if (vHashes.empty())
+        return uint256();
+    while (vHashes.size() > 1) {
+        std::vector<uint256> vNext;
+        for (size_t i = 0; i < vHashes.size(); i += 2) {
+            size_t i2 = std::min(i + 1, vHashes.size() - 1);
+            if (i2 == i + 1 && vHashes[i] == vHashes[i2])
+                fMutated = true;
+            vNext.push_back(Hash(vHashes[i].begin(), vHashes[i].end(), vHashes[i2].begin(), vHashes[i2].end()));
+        }
+        vHashes.swap(vNext);
+    }
+    return vHashes[0];
+}
+
+/** A block of n distinct transactions, the last nDuplicate of them repeated at the end */
+static CBlock MakeBlock(int n, int nDuplicate)
+{
+    CBlock block;
+    for (int i = 0; i < n; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        block.vtx.push_back(MakeTransactionRef(tx));
+    }
+    for (int i = 0; i < nDuplicate; i++)
+        block.vtx.push_back(block.vtx[n - nDuplicate + i]);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_matches_naive)
+{
+    for (int n = 0; n < 70; n++) {
+        CBlock block = MakeBlock(n, 0);
+        std::vector<uint256> vLeaves;
+        for (const CTransactionRef& tx : block.vtx)
+            vLeaves.push_back(tx->GetHash());
+
+        bool fNaiveMutated, fMutated, fBlockMutated;
+        uint256 hashNaive = NaiveMerkleRoot(vLeaves, fNaiveMutated);
+        BOOST_CHECK(ComputeMerkleRoot(vLeaves, &fMutated) == hashNaive);
+        BOOST_CHECK(BlockMerkleRoot(block) == hashNaive);
+        BOOST_CHECK(block.BuildMerkleTree(&fBlockMutated) == hashNaive);
+        BOOST_CHECK(!fNaiveMutated && !fMutated && !fBlockMutated);
+
+        // Every level is kept, so branches still check out against the root
+        if (n > 0) {
+            int nIndex = GetRand(n);
+            BOOST_CHECK(CBlock::CheckMerkleBranch(vLeaves[nIndex], block.GetMerkleBranch(nIndex), nIndex) == hashNaive);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_mutated)
+{
+    // Repeating the last transactions (CVE-2012-2459) leaves the root as it was
+    for (int n = 3; n < 70; n += 2) {
+        CBlock block = MakeBlock(n, 1);
+        bool fMutated, fBlockMutated;
+        uint256 hashMutated = block.BuildMerkleTree(&fBlockMutated);
+        BOOST_CHECK(fBlockMutated);
+        BOOST_CHECK(BlockMerkleRoot(block, &fMutated) == hashMutated);
+        BOOST_CHECK(fMutated);
+
+        block.vtx.pop_back();
+        BOOST_CHECK(block.BuildMerkleTree(&fBlockMutated) == hashMutated);
+        BOOST_CHECK(!fBlockMutated);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_timing)
+{
+    CBlock block = MakeBlock(4000, 0);
+    std::vector<uint256> vLeaves;
+    for (const CTransactionRef& tx : block.vtx)
+        vLeaves.push_back(tx->GetHash());
+
+    uint256 hashNaive, hashBlock, hashCompute;
+    int64_t nStart = GetTimeMicros();
+    bool fMutated;
+    for (int i = 0; i < 100; i++)
+        hashNaive = NaiveMerkleRoot(vLeaves, fMutated);
+    int64_t nNaive = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        hashBlock = block.BuildMerkleTree();
+    int64_t nBlock = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        hashCompute = ComputeMerkleRoot(vLeaves);
+    int64_t nCompute = GetTimeMicros() - nStart;
+    BOOST_CHECK(hashBlock == hashNaive);
+    BOOST_CHECK(hashCompute == hashNaive);
+    BOOST_TEST_MESSAGE("100 merkle roots of 4000 transactions: " << nNaive / 1000 << "ms a pair at a time, " << nBlock / 1000 <<
+                       "ms BuildMerkleTree, " << nCompute / 1000 << "ms ComputeMerkleRoot");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,225 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+/** Drain what the node wrote to the other end of its socket, pushing the rest of its send queue out meanwhile */
+static std::vector<char> ReceiveSent(CNode& node, SOCKET hSocketPeer, size_t nBytes)
+{
+    std::vector<char> vData;
+    char pchBuf[65536];
+    while (vData.size() < nBytes) {
+        {
+            LOCK(node.cs_vSend);
+            SocketSendData(&node);
+        }
+        int nRead = recv(hSocketPeer, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nRead > 0)
+            vData.insert(vData.end(), pchBuf, pchBuf + nRead);
+        else if (nRead == 0 || (WSAGetLastError() != WSAEWOULDBLOCK && WSAGetLastError() != WSAEINTR))
+            break;
+    }
+    return vData;
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_send)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(CService("127.0.0.1", 1)), "", true);
+    node.ssSend.SetVersion(PROTOCOL_VERSION);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 42;
+    CTransaction tx(mtx);
+
+    // Larger than the socket buffer, so the queue has to be written in several rounds
+    std::vector<unsigned char> vBig(1000000, 0x5a);
+
+    CSendPathStats statsBefore = CNode::GetSendPathStats();
+    CSerializedNetMsg msgTx = CreateSerializedNetMsg(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, tx);
+    CSerializedNetMsg msgBig = CreateSerializedNetMsg(0, NetMsgType::BLOCK, vBig);
+    node.PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, tx);
+    node.PushSerializedMessage(msgBig);
+    node.PushSerializedMessage(msgTx);
+    node.PushMessage(NetMsgType::BLOCK, vBig);
+    node.PushSerializedMessage(msgTx);
+
+    size_t nTotal = 3 * msgTx->size() + 2 * msgBig->size();
+    std::vector<char> vSent = ReceiveSent(node, fds[1], nTotal);
+    BOOST_REQUIRE_EQUAL(vSent.size(), nTotal);
+
+    // Messages serialized once go out byte for byte as those serialized for the peer, in queue order
+    std::vector<char>::const_iterator it = vSent.begin();
+    BOOST_CHECK(std::equal(msgTx->begin(), msgTx->end(), it));
+    it += msgTx->size();
+    BOOST_CHECK(std::equal(msgBig->begin(), msgBig->end(), it));
+    it += msgBig->size();
+    BOOST_CHECK(std::equal(msgTx->begin(), msgTx->end(), it));
+    it += msgTx->size();
+    BOOST_CHECK(std::equal(msgBig->begin(), msgBig->end(), it));
+    it += msgBig->size();
+    BOOST_CHECK(std::equal(msgTx->begin(), msgTx->end(), it));
+
+    {
+        LOCK(node.cs_vSend);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+        BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    }
+
+    CSendPathStats statsAfter = CNode::GetSendPathStats();
+    BOOST_CHECK_EQUAL(statsAfter.nSerializedBytes - statsBefore.nSerializedBytes, msgTx->size() + msgBig->size());
+    BOOST_CHECK_EQUAL(statsAfter.nSharedBytes - statsBefore.nSharedBytes, 2 * msgTx->size() + msgBig->size());
+    BOOST_CHECK(statsAfter.nSendBuffers - statsBefore.nSendBuffers >= statsAfter.nSendCalls - statsBefore.nSendCalls);
+
+    // Both ways of queueing are accounted per message type
+    CNodeStats nodeStats;
+    node.copyStats(nodeStats);
+    BOOST_CHECK_EQUAL(nodeStats.mapSendPerMsgCmd[NetMsgType::TX].nCount, 3U);
+    BOOST_CHECK_EQUAL(nodeStats.mapSendPerMsgCmd[NetMsgType::TX].nBytes, 3 * msgTx->size());
+    BOOST_CHECK_EQUAL(nodeStats.mapSendPerMsgCmd[NetMsgType::BLOCK].nCount, 2U);
+    BOOST_CHECK_EQUAL(nodeStats.mapSendPerMsgCmd[NetMsgType::BLOCK].nBytes, 2 * msgBig->size());
+
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(priority_message_send)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(CService("127.0.0.1", 1)), "", true);
+    node.ssSend.SetVersion(PROTOCOL_VERSION);
+
+    std::vector<unsigned char> vBig(1000000, 0x5a);
+    CSerializedNetMsg msgBig = CreateSerializedNetMsg(0, NetMsgType::BLOCK, vBig);
+    CSerializedNetMsg msgGetData = CreateSerializedNetMsg(0, NetMsgType::TX, vBig);
+    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, uint256(42)));
+    CSerializedNetMsg msgInv = CreateSerializedNetMsg(0, NetMsgType::INV, vInv);
+    CSerializedNetMsg msgVote = CreateSerializedNetMsg(0, NetMsgType::MNW, vInv);
+    BOOST_CHECK(GetDefaultSendClass(NetMsgType::MNW) == SEND_CLASS_PRIORITY);
+    BOOST_CHECK(GetDefaultSendClass(NetMsgType::BLOCK) == SEND_CLASS_BULK);
+
+    CSendLatencyStats priorityBefore = CNode::GetSendLatencyStats(SEND_CLASS_PRIORITY);
+    CSendLatencyStats bulkBefore = CNode::GetSendLatencyStats(SEND_CLASS_BULK);
+
+    // The first message is partly written right away and has to finish first; the
+    // priority ones overtake the bulk message queued behind it, in their own order
+    node.PushSerializedMessage(msgBig);
+    node.PushSerializedMessage(msgGetData);
+    node.PushMessageWithClass(SEND_CLASS_PRIORITY, NetMsgType::INV, vInv);
+    node.PushSerializedMessage(msgVote);
+
+    size_t nTotal = msgBig->size() + msgGetData->size() + msgInv->size() + msgVote->size();
+    std::vector<char> vSent = ReceiveSent(node, fds[1], nTotal);
+    BOOST_REQUIRE_EQUAL(vSent.size(), nTotal);
+
+    std::vector<char>::const_iterator it = vSent.begin();
+    BOOST_CHECK(std::equal(msgBig->begin(), msgBig->end(), it));
+    it += msgBig->size();
+    BOOST_CHECK(std::equal(msgInv->begin(), msgInv->end(), it));
+    it += msgInv->size();
+    BOOST_CHECK(std::equal(msgVote->begin(), msgVote->end(), it));
+    it += msgVote->size();
+    BOOST_CHECK(std::equal(msgGetData->begin(), msgGetData->end(), it));
+
+    CSendLatencyStats priorityAfter = CNode::GetSendLatencyStats(SEND_CLASS_PRIORITY);
+    CSendLatencyStats bulkAfter = CNode::GetSendLatencyStats(SEND_CLASS_BULK);
+    BOOST_CHECK_EQUAL(priorityAfter.nCount - priorityBefore.nCount, 2U);
+    BOOST_CHECK_EQUAL(bulkAfter.nCount - bulkBefore.nCount, 2U);
+    uint64_t nBucketed = 0;
+    for (int n = 0; n < SEND_LATENCY_BUCKETS; n++)
+        nBucketed += priorityAfter.vBuckets[n] - priorityBefore.vBuckets[n];
+    BOOST_CHECK_EQUAL(nBucketed, 2U);
+
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(send_latency_buckets)
+{
+    CSendLatencyStats stats;
+    stats.Add(500);
+    stats.Add(1000);
+    stats.Add(3999);
+    stats.Add(-1);
+    stats.Add(3600 * 1000000LL);
+    BOOST_CHECK_EQUAL(stats.nCount, 5U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[0], 2U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[2], 1U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[SEND_LATENCY_BUCKETS - 1], 1U);
+}
+
+BOOST_AUTO_TEST_CASE(received_message_accounting)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 1)), "", true);
+    CSerializedNetMsg msgPing = CreateSerializedNetMsg(0, NetMsgType::PING, (uint64_t)42);
+    CSerializedNetMsg msgUnknown = CreateSerializedNetMsg(0, "nosuchcmd", (uint64_t)42);
+    {
+        LOCK(node.cs_vRecvMsg);
+        // Split in two, only complete messages are accounted
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*msgPing)[0], 10));
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*msgPing)[10], msgPing->size() - 10));
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*msgUnknown)[0], msgUnknown->size()));
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*msgUnknown)[0], msgUnknown->size()));
+    }
+
+    CNodeStats nodeStats;
+    node.copyStats(nodeStats);
+    BOOST_CHECK_EQUAL(nodeStats.mapRecvPerMsgCmd[NetMsgType::PING].nCount, 1U);
+    BOOST_CHECK_EQUAL(nodeStats.mapRecvPerMsgCmd[NetMsgType::PING].nBytes, msgPing->size());
+    // Peers cannot grow the counters with made up message types
+    BOOST_CHECK(!nodeStats.mapRecvPerMsgCmd.count("nosuchcmd"));
+    BOOST_CHECK_EQUAL(nodeStats.mapRecvPerMsgCmd[NET_MESSAGE_COMMAND_OTHER].nCount, 2U);
+    BOOST_CHECK_EQUAL(nodeStats.mapRecvPerMsgCmd[NET_MESSAGE_COMMAND_OTHER].nBytes, 2 * msgUnknown->size());
+}
+
+BOOST_AUTO_TEST_CASE(upload_target)
+{
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // A large target leaves room for historical blocks until it is used up
+    uint64_t nTarget = 100 * CNode::GetMaxOutboundTimeframe() / Params().TargetSpacing() * MAX_BLOCK_SIZE_CURRENT;
+    CNode::SetMaxOutboundTarget(nTarget);
+    CNode::RecordBytesSent(1000);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK(CNode::GetOutboundTargetBytesLeft() <= nTarget - 1000);
+    BOOST_CHECK(CNode::GetMaxOutboundTimeLeftInCycle() <= CNode::GetMaxOutboundTimeframe());
+
+    // Historical blocks stop first, while there is still room to relay new blocks
+    CNode::RecordBytesSent(nTarget - CNode::GetMaxOutboundTimeframe() / Params().TargetSpacing() * MAX_BLOCK_SIZE_CURRENT);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+
+    CNode::RecordBytesSent(nTarget);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
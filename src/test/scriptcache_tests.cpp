@@ -0,0 +1,96 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "random.h"
+#include "script/interpreter.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(scriptcache_tests)
+
+BOOST_AUTO_TEST_CASE(script_execution_cache)
+{
+    // A transaction whose scripts were fully verified with a set of flags
+    // is not verified again with the same flags, e.g. when a block
+    // includes a transaction that was checked on its way into the mempool.
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction txFrom;
+    txFrom.vin.resize(1);
+    txFrom.vin[0].prevout.hash = GetRandHash();
+    txFrom.vin[0].prevout.n = 0;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = 11 * CENT;
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+
+    // Spent coins sit on top of the tip so CheckInputs can look up the spend height
+    CCoinsViewCache view(pcoinsTip);
+    view.ModifyCoins(txFrom.GetHash())->FromTx(txFrom, 0);
+
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout.hash = txFrom.GetHash();
+    txSpend.vin[0].prevout.n = 0;
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 10 * CENT;
+    txSpend.vout[0].scriptPubKey = scriptPubKey;
+    BOOST_CHECK(SignSignature(keystore, txFrom, txSpend, 0, SIGHASH_ALL));
+
+    const CTransaction tx(txSpend);
+    PrecomputedTransactionData txdata(tx);
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+    CValidationState state;
+    std::vector<CScriptCheck> vChecks;
+
+    // Nothing cached yet: the script check is handed back to the caller
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    BOOST_CHECK(vChecks[0]());
+
+    // Checks handed back through pvChecks have not run, so they are not cached
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+    // Verifying without cacheStore does not populate the cache either
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, false, txdata, NULL));
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+    // A full verification with cacheStore is remembered
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, txdata, NULL));
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks));
+    BOOST_CHECK(vChecks.empty());
+
+    // The entry only covers the flags it was verified with
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags | SCRIPT_VERIFY_NULLDUMMY, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+    // A different transaction spending the same coin is not covered
+    CMutableTransaction txOther(txSpend);
+    txOther.vout[0].nValue = 9 * CENT;
+    BOOST_CHECK(SignSignature(keystore, txFrom, txOther, 0, SIGHASH_ALL));
+    const CTransaction txOtherConst(txOther);
+    PrecomputedTransactionData txdataOther(txOtherConst);
+    vChecks.clear();
+    BOOST_CHECK(CheckInputs(txOtherConst, state, view, true, flags, true, txdataOther, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "serialize.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
 #include "streams.h"
+#include "version.h"
 
 #include <stdint.h>
 
@@ -161,4 +165,106 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(prevector_as_vector)
+{
+    // A prevector is written exactly like a vector of the same contents,
+    // whether it holds them inline or on the heap
+    for (unsigned int n = 0; n < 100; n++) {
+        std::vector<unsigned char> vch;
+        for (unsigned int i = 0; i < n; i++)
+            vch.push_back((unsigned char)(i * 7 + n));
+        CScript script(vch.begin(), vch.end());
+        BOOST_CHECK_EQUAL(script.allocated_memory() == 0, n <= 28);
+
+        CDataStream ssVector(SER_DISK, 0);
+        ssVector << vch;
+        CDataStream ssScript(SER_DISK, 0);
+        ssScript << script;
+        BOOST_CHECK(ssVector.str() == ssScript.str());
+        BOOST_CHECK_EQUAL(::GetSerializeSize(script, SER_DISK, 0), ssVector.size());
+
+        CScript scriptRead;
+        ssVector >> scriptRead;
+        BOOST_CHECK(scriptRead == script);
+    }
+}
+
+static CTransaction MakeTestTransaction(unsigned int n)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout.hash = uint256(n);
+    mtx.vin[0].prevout.n = n;
+    mtx.vin[0].scriptSig = CScript() << OP_1 << n;
+    mtx.vout.resize(2);
+    mtx.vout[0].nValue = n;
+    mtx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mtx.vout[1].nValue = 2 * n;
+    mtx.vout[1].scriptPubKey = CScript() << OP_RETURN;
+    mtx.nLockTime = n;
+    return CTransaction(mtx);
+}
+
+BOOST_AUTO_TEST_CASE(transaction_ref)
+{
+    // A shared transaction is written exactly like the transaction itself
+    CTransaction tx = MakeTestTransaction(1);
+    CTransactionRef ref = MakeTransactionRef(tx);
+
+    CDataStream ssValue(SER_NETWORK, PROTOCOL_VERSION);
+    ssValue << tx;
+    CDataStream ssRef(SER_NETWORK, PROTOCOL_VERSION);
+    ssRef << ref;
+    BOOST_CHECK(ssValue.str() == ssRef.str());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(ref, SER_NETWORK, PROTOCOL_VERSION), ssValue.size());
+
+    CTransactionRef refRead;
+    ssRef >> refRead;
+    BOOST_REQUIRE(refRead);
+    BOOST_CHECK(refRead->GetHash() == tx.GetHash());
+
+    // Reading into a ref that is also held elsewhere replaces the ref and
+    // leaves the object the other holder sees untouched
+    CTransactionRef refHeld = ref;
+    CTransaction tx2 = MakeTestTransaction(2);
+    CDataStream ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss2 << tx2;
+    ss2 >> ref;
+    BOOST_CHECK(ref->GetHash() == tx2.GetHash());
+    BOOST_CHECK(refHeld->GetHash() == tx.GetHash());
+    BOOST_CHECK(ref != refHeld);
+}
+
+BOOST_AUTO_TEST_CASE(block_transaction_refs)
+{
+    // A block holding its transactions by reference serializes as it did
+    // holding them by value
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = uint256(1);
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0ffff0;
+    std::vector<CTransaction> vtxValue;
+    for (unsigned int n = 1; n <= 3; n++) {
+        vtxValue.push_back(MakeTestTransaction(n));
+        block.vtx.push_back(MakeTransactionRef(vtxValue.back()));
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CDataStream ssValue(SER_NETWORK, PROTOCOL_VERSION);
+    ssValue << block.GetBlockHeader() << vtxValue;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    BOOST_CHECK(ssValue.str() == ssBlock.str());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION), ssValue.size());
+
+    CBlock blockRead;
+    ssBlock >> blockRead;
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_REQUIRE_EQUAL(blockRead.vtx.size(), vtxValue.size());
+    for (unsigned int i = 0; i < vtxValue.size(); i++)
+        BOOST_CHECK(blockRead.vtx[i]->GetHash() == vtxValue[i].GetHash());
+    BOOST_CHECK(blockRead.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include <time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+#ifndef WIN32
+static const int STRESS_PEERS = 200;
+static const int STRESS_ROUNDS = 50;
+static const size_t STRESS_MESSAGE_SIZE = 32;
+
+static void CheckBasicEvents(CSocketEvents& events)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    const char msg[] = "ping";
+
+    // Nothing to read yet
+    events.Add(fds[0], SOCKET_EVENT_RECV | SOCKET_EVENT_ERR, 1);
+    BOOST_CHECK(events.Wait(0));
+    BOOST_CHECK_EQUAL(events.GetEvents(fds[0]), (unsigned int)SOCKET_EVENT_NONE);
+
+    // Readable once the other end wrote, writable always; the other end was never declared
+    BOOST_CHECK_EQUAL(send(fds[1], msg, sizeof(msg), 0), (ssize_t)sizeof(msg));
+    events.Add(fds[0], SOCKET_EVENT_RECV | SOCKET_EVENT_SEND, 1);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK_EQUAL(events.GetEvents(fds[0]), (unsigned int)(SOCKET_EVENT_RECV | SOCKET_EVENT_SEND));
+    BOOST_CHECK_EQUAL(events.GetEvents(fds[1]), (unsigned int)SOCKET_EVENT_NONE);
+
+    // Interest can be narrowed between iterations
+    events.Add(fds[0], SOCKET_EVENT_SEND, 1);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK_EQUAL(events.GetEvents(fds[0]), (unsigned int)SOCKET_EVENT_SEND);
+
+    // A socket number reused by another connection is picked up as a new socket
+    close(fds[0]);
+    close(fds[1]);
+    int fdsNew[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fdsNew) == 0);
+    events.Add(fdsNew[0], SOCKET_EVENT_RECV, 2);
+    BOOST_CHECK(events.Wait(0));
+    BOOST_CHECK_EQUAL(events.GetEvents(fdsNew[0]), (unsigned int)SOCKET_EVENT_NONE);
+    BOOST_CHECK_EQUAL(send(fdsNew[1], msg, sizeof(msg), 0), (ssize_t)sizeof(msg));
+    events.Add(fdsNew[0], SOCKET_EVENT_RECV, 2);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK_EQUAL(events.GetEvents(fdsNew[0]), (unsigned int)SOCKET_EVENT_RECV);
+
+    // A hung up peer is reported, so the caller's recv() can notice it
+    close(fdsNew[1]);
+    events.Add(fdsNew[0], SOCKET_EVENT_RECV | SOCKET_EVENT_ERR, 2);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK(events.GetEvents(fdsNew[0]) & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR));
+    close(fdsNew[0]);
+}
+
+/** Relay STRESS_ROUNDS messages to every one of STRESS_PEERS local peers and return the CPU time spent per message */
+static double StressEvents(CSocketEvents& events)
+{
+    std::vector<std::pair<int, int> > vPeers;
+    for (int i = 0; i < STRESS_PEERS; i++) {
+        int fds[2];
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        vPeers.push_back(std::make_pair(fds[0], fds[1]));
+    }
+
+    const std::vector<char> vMessage(STRESS_MESSAGE_SIZE, 'x');
+    std::vector<char> vBuf(STRESS_MESSAGE_SIZE * STRESS_ROUNDS);
+    int64_t nReceived = 0;
+    clock_t nStart = clock();
+    for (int nRound = 0; nRound < STRESS_ROUNDS; nRound++) {
+        // Only one peer in ten is active per round, the others idle
+        for (size_t i = nRound % 10; i < vPeers.size(); i += 10)
+            BOOST_REQUIRE(send(vPeers[i].second, &vMessage[0], vMessage.size(), 0) == (ssize_t)vMessage.size());
+
+        for (size_t i = 0; i < vPeers.size(); i++)
+            events.Add(vPeers[i].first, SOCKET_EVENT_RECV | SOCKET_EVENT_ERR, i);
+        BOOST_REQUIRE(events.Wait(1000));
+        for (size_t i = 0; i < vPeers.size(); i++) {
+            if (!(events.GetEvents(vPeers[i].first) & SOCKET_EVENT_RECV))
+                continue;
+            ssize_t nBytes = recv(vPeers[i].first, &vBuf[0], vBuf.size(), MSG_DONTWAIT);
+            if (nBytes > 0)
+                nReceived += nBytes;
+        }
+    }
+    double dCpuSeconds = (double)(clock() - nStart) / CLOCKS_PER_SEC;
+
+    // Every message sent must have been seen
+    int64_t nSent = 0;
+    for (int nRound = 0; nRound < STRESS_ROUNDS; nRound++)
+        nSent += ((STRESS_PEERS - nRound % 10 + 9) / 10) * STRESS_MESSAGE_SIZE;
+    BOOST_CHECK_EQUAL(nReceived, nSent);
+
+    for (size_t i = 0; i < vPeers.size(); i++) {
+        close(vPeers[i].first);
+        close(vPeers[i].second);
+    }
+    return dCpuSeconds / (nSent / STRESS_MESSAGE_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_basic)
+{
+    for (const std::string& strMode : GetSocketEventsModes()) {
+        boost::scoped_ptr<CSocketEvents> pEvents(CreateSocketEvents(strMode));
+        BOOST_REQUIRE(pEvents);
+        BOOST_CHECK_EQUAL(pEvents->GetName(), strMode);
+        CheckBasicEvents(*pEvents);
+    }
+    BOOST_CHECK(CreateSocketEvents("nonexistent") == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_stress)
+{
+    for (const std::string& strMode : GetSocketEventsModes()) {
+        boost::scoped_ptr<CSocketEvents> pEvents(CreateSocketEvents(strMode));
+        BOOST_REQUIRE(pEvents);
+        double dPerMessage = StressEvents(*pEvents);
+        BOOST_TEST_MESSAGE(strMode << ": " << dPerMessage * 1000000 << " us CPU per message with " << STRESS_PEERS << " peers");
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
@@ -31,10 +32,19 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    //! Incremented before and after every BatchWrite, so it is odd while one is in progress
+    std::atomic<uint64_t> nWriteSequence;
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
+    /**
+     * Changes whenever the database is written to. Coins read while it is even
+     * and unchanged since are still current; readers on other threads use this
+     * to tell whether what they read may be used.
+     */
+    uint64_t GetWriteSequence() const { return nWriteSequence; }
+
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
@@ -0,0 +1,175 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanpool.h"
+
+#include "random.h"
+#include "util.h"
+#include "version.h"
+
+#include <assert.h>
+
+COrphanTxPool::COrphanTxPool() : nTotalTxSize(0), nNextSweep(0)
+{
+}
+
+bool COrphanTxPool::AddTx(const CTransactionRef& ptx, NodeId peer, int64_t nNow)
+{
+    const CTransaction& tx = *ptx;
+    const uint256 hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz > MAX_ORPHAN_TX_SIZE) {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphans[hash];
+    orphan.tx = ptx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = nNow + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
+    orphan.nListPos = vOrphanList.size();
+    vOrphanList.push_back(hash);
+
+    for (const CTxIn& txin : tx.vin)
+        mapOrphansByPrev[txin.prevout.hash].insert(hash);
+    mapOrphansByPeer[peer].insert(hash);
+    setExpiry.insert(std::make_pair(orphan.nTimeExpire, hash));
+    nTotalTxSize += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+        mapOrphans.size(), mapOrphansByPrev.size(), nTotalTxSize);
+    return true;
+}
+
+bool COrphanTxPool::EraseTx(const uint256& hash)
+{
+    std::map<uint256, COrphanTx>::iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    const COrphanTx& orphan = it->second;
+
+    for (const CTxIn& txin : orphan.tx->vin) {
+        std::map<uint256, std::set<uint256> >::iterator itPrev = mapOrphansByPrev.find(txin.prevout.hash);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    std::map<NodeId, std::set<uint256> >::iterator itPeer = mapOrphansByPeer.find(orphan.fromPeer);
+    if (itPeer != mapOrphansByPeer.end()) {
+        itPeer->second.erase(hash);
+        if (itPeer->second.empty())
+            mapOrphansByPeer.erase(itPeer);
+    }
+
+    setExpiry.erase(std::make_pair(orphan.nTimeExpire, hash));
+
+    // Keep vOrphanList dense by moving its last element into the freed slot
+    size_t nOldPos = orphan.nListPos;
+    assert(nOldPos < vOrphanList.size() && vOrphanList[nOldPos] == hash);
+    if (nOldPos + 1 != vOrphanList.size()) {
+        const uint256& hashLast = vOrphanList.back();
+        mapOrphans[hashLast].nListPos = nOldPos;
+        vOrphanList[nOldPos] = hashLast;
+    }
+    vOrphanList.pop_back();
+
+    nTotalTxSize -= orphan.nTxSize;
+    mapOrphans.erase(it);
+    return true;
+}
+
+unsigned int COrphanTxPool::EraseForPeer(NodeId peer)
+{
+    std::map<NodeId, std::set<uint256> >::iterator itPeer = mapOrphansByPeer.find(peer);
+    if (itPeer == mapOrphansByPeer.end())
+        return 0;
+
+    // EraseTx modifies the per-peer set, so work on a copy
+    std::vector<uint256> vErase(itPeer->second.begin(), itPeer->second.end());
+    unsigned int nErased = 0;
+    for (const uint256& hash : vErase)
+        nErased += EraseTx(hash) ? 1 : 0;
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    return nErased;
+}
+
+unsigned int COrphanTxPool::Expire(int64_t nNow)
+{
+    if (nNextSweep > nNow)
+        return 0;
+
+    unsigned int nErased = 0;
+    while (!setExpiry.empty() && setExpiry.begin()->first <= nNow) {
+        EraseTx(setExpiry.begin()->second);
+        ++nErased;
+    }
+    // Sweep again ORPHAN_TX_EXPIRE_INTERVAL after the next entry expires, so expirations are batched
+    nNextSweep = (setExpiry.empty() ? nNow + ORPHAN_TX_EXPIRE_TIME : setExpiry.begin()->first) + ORPHAN_TX_EXPIRE_INTERVAL;
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    return nErased;
+}
+
+unsigned int COrphanTxPool::LimitSize(unsigned int nMaxOrphans, size_t nMaxBytes)
+{
+    unsigned int nEvicted = 0;
+    while (!vOrphanList.empty() && (mapOrphans.size() > nMaxOrphans || nTotalTxSize > nMaxBytes)) {
+        // Evict a random orphan:
+        EraseTx(vOrphanList[GetRand(vOrphanList.size())]);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void COrphanTxPool::Clear()
+{
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    mapOrphansByPeer.clear();
+    setExpiry.clear();
+    vOrphanList.clear();
+    nTotalTxSize = 0;
+    nNextSweep = 0;
+}
+
+bool COrphanTxPool::HaveTx(const uint256& hash) const
+{
+    return mapOrphans.count(hash) > 0;
+}
+
+const COrphanTx* COrphanTxPool::GetTx(const uint256& hash) const
+{
+    std::map<uint256, COrphanTx>::const_iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return NULL;
+    return &it->second;
+}
+
+void COrphanTxPool::GetChildren(const uint256& hashPrev, std::vector<uint256>& vChildren) const
+{
+    std::map<uint256, std::set<uint256> >::const_iterator itByPrev = mapOrphansByPrev.find(hashPrev);
+    if (itByPrev == mapOrphansByPrev.end())
+        return;
+    vChildren.insert(vChildren.end(), itByPrev->second.begin(), itByPrev->second.end());
+}
+
+unsigned int COrphanTxPool::CountForPeer(NodeId peer) const
+{
+    std::map<NodeId, std::set<uint256> >::const_iterator itPeer = mapOrphansByPeer.find(peer);
+    if (itPeer == mapOrphansByPeer.end())
+        return 0;
+    return itPeer->second.size();
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/** Orphans larger than this (in bytes) are never stored */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+struct COrphanTx {
+    CTransactionRef tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+    //! Position in COrphanTxPool::vOrphanList, used for O(1) random eviction
+    size_t nListPos;
+};
+
+/**
+ * Transactions we received whose inputs are not (yet) known to us.
+ *
+ * Orphans are indexed by hash, by the hashes of the transactions they spend
+ * from, by the peer that relayed them and by their expiry time, so that
+ * resolution, peer disconnection and expiry never have to scan the whole pool.
+ *
+ * The pool is not thread safe on its own; callers in main.cpp hold cs_main.
+ */
+class COrphanTxPool
+{
+private:
+    std::map<uint256, COrphanTx> mapOrphans;
+    std::map<uint256, std::set<uint256> > mapOrphansByPrev;
+    std::map<NodeId, std::set<uint256> > mapOrphansByPeer;
+    std::set<std::pair<int64_t, uint256> > setExpiry;
+    std::vector<uint256> vOrphanList;
+    size_t nTotalTxSize;
+    int64_t nNextSweep;
+
+public:
+    COrphanTxPool();
+
+    /** Store tx as an orphan relayed by peer. Returns false if it is already known or too large. */
+    bool AddTx(const CTransactionRef& tx, NodeId peer, int64_t nNow);
+    /** Remove a single orphan. Returns false if it was not in the pool. */
+    bool EraseTx(const uint256& hash);
+    /** Remove all orphans relayed by peer, without touching those of other peers. */
+    unsigned int EraseForPeer(NodeId peer);
+    /** Remove orphans whose expiry time has passed. Only sweeps once per ORPHAN_TX_EXPIRE_INTERVAL. */
+    unsigned int Expire(int64_t nNow);
+    /** Randomly evict orphans until at most nMaxOrphans remain and they use at most nMaxBytes. */
+    unsigned int LimitSize(unsigned int nMaxOrphans, size_t nMaxBytes);
+    void Clear();
+
+    bool HaveTx(const uint256& hash) const;
+    const COrphanTx* GetTx(const uint256& hash) const;
+    /** Hashes of the orphans spending an output of hashPrev. */
+    void GetChildren(const uint256& hashPrev, std::vector<uint256>& vChildren) const;
+    unsigned int CountForPeer(NodeId peer) const;
+
+    size_t Size() const { return mapOrphans.size(); }
+    size_t TotalTxSize() const { return nTotalTxSize; }
+};
+
+#endif // BITCOIN_TXORPHANPOOL_H
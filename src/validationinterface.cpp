@@ -54,6 +54,6 @@ void UnregisterAllValidationInterfaces() {
 // XX42    g_signals.EraseTransaction.disconnect_all_slots();
 }
 
-void SyncWithWallets(const CTransaction &tx, const CBlock *pblock = NULL) {
+void SyncWithWallets(const CTransactionRef &tx, const CBlock *pblock = NULL) {
     g_signals.SyncTransaction(tx, pblock);
 }
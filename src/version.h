@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70814;
+static const int PROTOCOL_VERSION = 70816;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -20,6 +20,13 @@ static const int INIT_PROTO_VERSION = 209;
 //! In this version, 'getheaders' was introduced.
 static const int GETHEADERS_VERSION = 70000;
 
+//! 'getheaders' is answered with 'headers' (rather than block invs) starting with this version,
+//! on networks that sync headers first (CChainParams::HeadersFirstSyncingActive)
+static const int HEADERS_FIRST_VERSION = 70815;
+
+//! "feefilter" tells peers to filter tx invs to us by fee rate starting with this version
+static const int FEEFILTER_VERSION = 70816;
+
 //! disconnect from peers older than this proto version
 static const int MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT = 70813;
 static const int MIN_PEER_PROTO_VERSION_AFTER_ENFORCEMENT = 70814;